@@ -0,0 +1,92 @@
+#ifndef IOLISP_BATCH_HPP
+#define IOLISP_BATCH_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./interpreter.hpp"
+#include "./interpreter_pool.hpp"
+#include "./show.hpp"
+
+namespace iolisp
+{
+namespace batch_detail
+{
+struct result
+{
+    bool done = false;
+    int status = 0;
+    std::string output;
+    std::string error;
+};
+}
+
+// Runs independent scripts concurrently on the pool, each as iolisp runs
+// one, with no arguments. What a script writes is kept until it and every
+// script before it have finished, then written to out under a header
+// naming it with its exit status:
+//
+//     ==> script.scm (status 0) <==
+//
+// so the output is the same whatever order they finish in. Errors go to
+// err, after the script's name. Returns 1 if any script failed, otherwise
+// 0.
+inline int run_batch(
+    interpreter_pool &pool,
+    std::vector<std::string> const &scripts,
+    std::ostream &out,
+    std::ostream &err)
+{
+    std::vector<batch_detail::result> results(scripts.size());
+    std::mutex mutex;
+    std::condition_variable finished;
+    for (std::size_t i = 0; i != scripts.size(); ++i)
+        pool.submit([&, i](interpreter &interp, std::ostream &console)
+            {
+                batch_detail::result r;
+                std::stringbuf buf;
+                console.rdbuf(&buf);
+                try
+                {
+                    console << interp.run(scripts[i], {}) << std::endl;
+                }
+                catch (std::exception const &e)
+                {
+                    r.status = 1;
+                    r.error = e.what();
+                }
+                console.flush();
+                console.rdbuf(nullptr);
+                r.output = buf.str();
+                r.done = true;
+                // Notified under the lock, since once the last result is in,
+                // run_batch may return and take finished with it.
+                std::lock_guard<std::mutex> lock(mutex);
+                results[i] = std::move(r);
+                finished.notify_all();
+            });
+
+    auto status = 0;
+    for (std::size_t i = 0; i != scripts.size(); ++i)
+    {
+        batch_detail::result r;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&] { return results[i].done; });
+            r = std::move(results[i]);
+        }
+        out << "==> " << scripts[i] << " (status " << r.status << ") <==\n" << r.output << std::flush;
+        if (r.status != 0)
+            err << scripts[i] << ": " << r.error << std::endl;
+        status |= r.status;
+    }
+    return status;
+}
+}
+
+#endif
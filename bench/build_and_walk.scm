@@ -0,0 +1,16 @@
+(define (build n acc)
+  (if (= n 0)
+      acc
+      (build (- n 1) (cons n acc))))
+
+(define (walk lst acc)
+  (if (eq? lst '())
+      acc
+      (walk (cdr lst) (+ acc (car lst)))))
+
+(define (rounds k acc)
+  (if (= k 0)
+      acc
+      (rounds (- k 1) (walk (build 100000 '()) acc))))
+
+(rounds 10 0)
@@ -0,0 +1,82 @@
+(define (iota n acc)
+  (if (= n 0)
+      acc
+      (iota (- n 1) (cons n acc))))
+
+(define numbers (iota 100000 '()))
+
+(define (sq x) (* x x))
+
+(define (my-reverse lst acc)
+  (if (eq? lst '())
+      acc
+      (my-reverse (cdr lst) (cons (car lst) acc))))
+
+(define (my-map-onto f lst acc)
+  (if (eq? lst '())
+      (my-reverse acc '())
+      (my-map-onto f (cdr lst) (cons (f (car lst)) acc))))
+
+(define (my-map f lst) (my-map-onto f lst '()))
+
+(define (my-fold-left f acc lst)
+  (if (eq? lst '())
+      acc
+      (my-fold-left f (f acc (car lst)) (cdr lst))))
+
+(define (my-length lst n)
+  (if (eq? lst '())
+      n
+      (my-length (cdr lst) (+ n 1))))
+
+(define (take-half lst n acc)
+  (if (= n 0)
+      (cons (my-reverse acc '()) lst)
+      (take-half (cdr lst) (- n 1) (cons (car lst) acc))))
+
+(define (merge a b acc)
+  (if (eq? a '())
+      (my-reverse acc b)
+      (if (eq? b '())
+          (my-reverse acc a)
+          (if (< (car b) (car a))
+              (merge a (cdr b) (cons (car b) acc))
+              (merge (cdr a) b (cons (car a) acc))))))
+
+(define (merge-halves halves)
+  (merge (my-sort (car halves)) (my-sort (cdr halves)) '()))
+
+(define (my-sort lst)
+  (if (< (my-length lst 0) 2)
+      lst
+      (merge-halves (take-half lst (quotient (my-length lst 0) 2) '()))))
+
+(define (passes k thunk)
+  (if (= k 0)
+      #t
+      (passes-after k thunk (thunk))))
+
+(define (passes-after k thunk result)
+  (passes (- k 1) thunk))
+
+(define descending (reverse numbers))
+
+(passes 5 (lambda () (my-map sq numbers)))
+
+(passes 5 (lambda () (map sq numbers)))
+
+(passes 5 (lambda () (my-fold-left + 0 numbers)))
+
+(passes 5 (lambda () (fold-left + 0 numbers)))
+
+(passes 5 (lambda () (my-length numbers 0)))
+
+(passes 5 (lambda () (length numbers)))
+
+(passes 5 (lambda () (my-reverse numbers '())))
+
+(passes 5 (lambda () (reverse numbers)))
+
+(my-sort descending)
+
+(sort descending <)
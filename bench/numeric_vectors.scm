@@ -0,0 +1,49 @@
+(define (iota n acc)
+  (if (= n 0)
+      acc
+      (iota (- n 1) (cons (* n 0.5) acc))))
+
+(define (iota-fixnums n acc)
+  (if (= n 0)
+      acc
+      (iota-fixnums (- n 1) (cons n acc))))
+
+(define (passes k thunk)
+  (if (= k 0)
+      #t
+      (passes-after k thunk (thunk))))
+
+(define (passes-after k thunk result)
+  (passes (- k 1) thunk))
+
+(define flonums (iota 100000 '()))
+
+(define fixnums (iota-fixnums 100000 '()))
+
+(define f64 (list->f64vector flonums))
+
+(define s64 (list->s64vector fixnums))
+
+(passes 10 (lambda () (fold-left + 0 flonums)))
+
+(passes 10 (lambda () (f64vector-sum f64)))
+
+(passes 10 (lambda () (fold-left + 0 fixnums)))
+
+(passes 10 (lambda () (s64vector-sum s64)))
+
+(passes 10 (lambda () (fold-left + 0 (map * flonums flonums))))
+
+(passes 10 (lambda () (f64vector-dot f64 f64)))
+
+(passes 10 (lambda () (map + flonums flonums)))
+
+(passes 10 (lambda () (f64vector-add f64 f64)))
+
+(passes 10 (lambda () (s64vector-add s64 s64)))
+
+(passes 10 (lambda () (f64vector-mul f64 2.0)))
+
+(passes 10 (lambda () (f64vector-prefix-sum f64)))
+
+(passes 10 (lambda () (f64vector-max f64)))
@@ -0,0 +1,15 @@
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (repeat x n acc)
+  (if (= n 0)
+      acc
+      (repeat x (- n 1) (cons x acc))))
+
+(define twenties (repeat 20 64 '()))
+
+(map fib twenties)
+
+(parallel-map fib twenties)
@@ -0,0 +1,38 @@
+#define BOOST_RESULT_OF_USE_DECLTYPE
+#define BOOST_SPIRIT_USE_PHOENIX_V3
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include "../read.hpp"
+
+using namespace iolisp;
+
+// Parses input with read 20000 times and reports the best of 5 runs in ns
+// per call. read parses with the grammar each thread keeps, as the REPL
+// does a line at a time.
+double read_cost(std::string const &input)
+{
+    static constexpr auto calls = 20000;
+    auto best = std::numeric_limits<double>::infinity();
+    for (auto run = 0; run != 5; ++run)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        for (auto i = 0; i != calls; ++i)
+            read(input);
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, std::chrono::duration<double, std::nano>(elapsed).count() / calls);
+    }
+    return best;
+}
+
+int main()
+{
+    for (std::string const input : {
+        "42",
+        "(+ 1 2)",
+        "(define (f x) (if (< x 2) x (+ (f (- x 1)) (f (- x 2)))))"})
+        std::printf("%8.0f ns  %s\n", read_cost(input), input.c_str());
+}
@@ -0,0 +1,88 @@
+#define BOOST_RESULT_OF_USE_DECLTYPE
+#define BOOST_SPIRIT_USE_PHOENIX_V3
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+#include "../interpreter.hpp"
+#include "../read.hpp"
+#include "../show.hpp"
+
+using namespace iolisp;
+
+bool is_definition(value const &form)
+{
+    return form.is<pair>() && form.get<pair>().car.is<atom>() &&
+        form.get<pair>().car.get<atom>() == symbol("define");
+}
+
+// time_forms [--repeat N] script...
+//
+// Evaluates the forms of each script in order, as load does, and prints
+// for each form other than a definition the best wall clock and CPU time
+// of N runs, 5 by default. The scripts in bench/ are written for it; run
+// them with b2 bench, which builds it optimised.
+int main(int argc, char *argv[])
+try
+{
+    auto first = argv + 1;
+    auto const last = argv + argc;
+    auto repeat = 5;
+    if (last - first >= 2 && first[0] == std::string("--repeat"))
+    {
+        repeat = std::max(std::atoi(first[1]), 1);
+        first += 2;
+    }
+    interpreter interp;
+    for (; first != last; ++first)
+    {
+        std::ifstream in(*first);
+        if (!in)
+            throw error(std::string("Could not open file: ") + *first);
+        std::string const text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        std::vector<value> forms;
+        {
+            interpreter::scope const scope(interp);
+            forms = read_expr_list(text);
+        }
+        std::cout << *first << std::endl;
+        for (auto const &form : forms)
+        {
+            if (is_definition(form))
+            {
+                interp.eval(form);
+                continue;
+            }
+            auto wall = std::numeric_limits<double>::infinity();
+            auto cpu = wall;
+            for (auto run = 0; run != repeat; ++run)
+            {
+                auto const start = std::chrono::steady_clock::now();
+                auto const start_cpu = std::clock();
+                interp.eval(form);
+                cpu = std::min(cpu, 1000.0 * (std::clock() - start_cpu) / CLOCKS_PER_SEC);
+                wall = std::min(
+                    wall,
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            auto text = show(form);
+            if (text.size() > 60)
+                text = text.substr(0, 57) + "...";
+            std::printf("%10.3f ms %10.3f ms cpu  %s\n", wall, cpu, text.c_str());
+        }
+    }
+    return 0;
+}
+catch (error const &e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,28 @@
+(define (write-numbers port n)
+  (if (= n 0)
+      (close-output-port port)
+      (write-next port n)))
+
+(define (write-next port n)
+  (write n port)
+  (write-numbers port (- n 1)))
+
+(define (write-simple-numbers port n)
+  (if (= n 0)
+      (close-output-port port)
+      (write-simple-next port n)))
+
+(define (write-simple-next port n)
+  (write-simple n port)
+  (write-simple-numbers port (- n 1)))
+
+(define (count n)
+  (if (= n 0)
+      #t
+      (count (- n 1))))
+
+(count 10000000)
+
+(write-numbers (open-output-file "write_loop.out") 10000000)
+
+(write-simple-numbers (open-output-file "write_loop.out") 10000000)
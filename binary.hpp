@@ -0,0 +1,625 @@
+#ifndef IOLISP_BINARY_HPP
+#define IOLISP_BINARY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include "./errors.hpp"
+#include "./hash_table.hpp"
+#include "./number.hpp"
+#include "./symbol.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// The binary encoding of a datum, as written by write-binary.
+//
+// A record is the magic bytes "iolb", a version byte, the payload length
+// as a varint, then the payload: a single encoded value. Every value starts
+// with a tag byte:
+//
+//   nil, false, true     no operand
+//   fixnum               zigzag varint
+//   bignum               sign byte, varint byte count, big-endian magnitude
+//   string               varint byte count, bytes
+//   symbol_def           varint byte count, bytes; the symbol is given the
+//                        next symbol index
+//   symbol_ref           varint symbol index
+//   list                 varint count n, n elements, then the tail
+//   shared               the value that follows is given the next object
+//                        index
+//   backref              varint object index
+//   vector               varint count n, n elements
+//   flonum               8 bytes, the IEEE double little-endian
+//   f64vector            varint count n, n doubles as for flonum
+//   s64vector            varint count n, n zigzag varints
+//   hash_table           kind byte (0 eq, 1 eqv, 2 equal), varint count n,
+//                        n keys each followed by its value
+//
+// Pairs, vectors of any kind, hash tables, strings and bignums referred to
+// from more than one place are written once, behind shared, and referred to
+// by index afterwards. A shared vector or table is given its index before
+// its elements are read, so it may contain itself; a shared pair only once
+// its run is read, since pairs never contain themselves. Lists are written
+// as runs, so a long list does not nest once per element. A record whose
+// values nest more than max_depth deep is rejected.
+namespace binary_detail
+{
+static constexpr char magic[4] = {'i', 'o', 'l', 'b'};
+static constexpr unsigned char version = 1;
+static constexpr std::size_t max_depth = 1000;
+
+enum class tag : unsigned char
+{
+    nil,
+    false_,
+    true_,
+    fixnum,
+    bignum,
+    string,
+    symbol_def,
+    symbol_ref,
+    list,
+    shared,
+    backref,
+    // Used only by images, for what plain data cannot contain.
+    function,
+    primitive,
+    io_primitive,
+    vector,
+    flonum,
+    f64vector,
+    s64vector,
+    hash_table
+};
+
+inline void put_varint(std::string &out, std::uint64_t n)
+{
+    for (; n >= 0x80; n >>= 7)
+        out.push_back(static_cast<char>((n & 0x7f) | 0x80));
+    out.push_back(static_cast<char>(n));
+}
+
+inline std::uint64_t zigzag(std::int64_t n)
+{
+    return (static_cast<std::uint64_t>(n) << 1) ^ static_cast<std::uint64_t>(n >> 63);
+}
+
+inline std::int64_t unzigzag(std::uint64_t n)
+{
+    return static_cast<std::int64_t>((n >> 1) ^ (~(n & 1) + 1));
+}
+
+class encoder
+{
+public:
+    virtual ~encoder() {}
+
+    std::string const &encode(value const &val)
+    {
+        emit(val);
+        return out_;
+    }
+
+    // Builds a list payload one element at a time, for decoder's
+    // decode_elements. Symbols and shared objects carry over from one
+    // element to the next.
+    void add_element(value const &val)
+    {
+        put(tag::list);
+        put_varint(1);
+        emit(val);
+    }
+
+    std::string const &end_elements()
+    {
+        put(tag::nil);
+        return out_;
+    }
+
+protected:
+    // Writes what is not plain data. Only images allow any.
+    virtual void emit_extension(value const &val)
+    {
+        throw type_mismatch("serializable value", val);
+    }
+
+    void put(tag t)
+    {
+        out_.push_back(static_cast<char>(t));
+    }
+
+    void put_bytes(boost::string_view bytes)
+    {
+        put_varint(bytes.size());
+        out_.append(bytes.data(), bytes.size());
+    }
+
+    void emit(value const &val)
+    {
+        if (val.is<nil>())
+            put(tag::nil);
+        else if (val.is<bool_>())
+            put(val.get<bool_>() ? tag::true_ : tag::false_);
+        else if (val.is<number>())
+        {
+            auto const n = val.get<number>();
+            put(tag::fixnum);
+            put_varint(zigzag(n));
+        }
+        else if (val.is<flonum>())
+        {
+            put(tag::flonum);
+            put_double(val.get<flonum>());
+        }
+        else if (val.is<atom>())
+            emit_symbol(val.get<atom>());
+        else if (!identity(val))
+            emit_extension(val);
+        else if (is_shared(val))
+            return;
+        else if (val.is<pair>())
+            emit_list(val);
+        else if (val.is<vector>())
+        {
+            put(tag::vector);
+            put_varint(val.get<vector>().size());
+            for (auto const &elem : val.get<vector>())
+                emit(elem);
+        }
+        else if (val.is<f64vector>())
+        {
+            put(tag::f64vector);
+            put_varint(val.get<f64vector>().size());
+            for (auto const elem : val.get<f64vector>())
+                put_double(elem);
+        }
+        else if (val.is<s64vector>())
+        {
+            put(tag::s64vector);
+            put_varint(val.get<s64vector>().size());
+            for (auto const elem : val.get<s64vector>())
+                put_varint(zigzag(elem));
+        }
+        else if (val.is<hash_table>())
+        {
+            auto const &table = val.get<hash_table>();
+            put(tag::hash_table);
+            out_.push_back(static_cast<char>(table.kind()));
+            put_varint(table.size());
+            table.for_each(
+                [this](value const &key, value const &elem)
+                {
+                    emit(key);
+                    emit(elem);
+                });
+        }
+        else if (is_text(val))
+        {
+            put(tag::string);
+            put_bytes(text_of(val));
+        }
+        else
+        {
+            auto const &n = val.get<bignum>();
+            std::string magnitude;
+            boost::multiprecision::export_bits(bigint(abs(n)), std::back_inserter(magnitude), 8);
+            put(tag::bignum);
+            out_.push_back(n.sign() < 0 ? 1 : 0);
+            put_bytes(magnitude);
+        }
+    }
+
+    void put_varint(std::uint64_t n)
+    {
+        binary_detail::put_varint(out_, n);
+    }
+
+    void put_double(double d)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        for (auto i = 0; i != 8; ++i, bits >>= 8)
+            out_.push_back(static_cast<char>(bits & 0xff));
+    }
+
+private:
+
+    void emit_symbol(symbol const &sym)
+    {
+        auto const it = symbols_.find(sym);
+        if (it != symbols_.end())
+        {
+            put(tag::symbol_ref);
+            put_varint(it->second);
+            return;
+        }
+        symbols_.emplace(sym, symbols_.size());
+        put(tag::symbol_def);
+        put_bytes(sym.name());
+    }
+
+    // Objects that other values also refer to are written once. Returns
+    // true if val was written as a reference to an earlier copy.
+    bool is_shared(value const &val)
+    {
+        if (val.use_count() <= 1)
+            return false;
+        auto const key = identity(val);
+        auto const it = objects_.find(key);
+        if (it != objects_.end())
+        {
+            put(tag::backref);
+            put_varint(it->second);
+            return true;
+        }
+        objects_.emplace(key, objects_.size());
+        // Held so that its address is not reused by a later object.
+        shared_.push_back(val);
+        put(tag::shared);
+        return false;
+    }
+
+    static void const *identity(value const &val)
+    {
+        if (val.is<pair>())
+            return &val.get<pair>();
+        else if (val.is<vector>())
+            return &val.get<vector>();
+        else if (val.is<f64vector>())
+            return &val.get<f64vector>();
+        else if (val.is<s64vector>())
+            return &val.get<s64vector>();
+        else if (val.is<hash_table>())
+            return &val.get<hash_table>();
+        else if (val.is<string>())
+            return &val.get<string>();
+        else if (val.is<string_slice>())
+            return &val.get<string_slice>();
+        else if (val.is<bignum>())
+            return &val.get<bignum>();
+        return nullptr;
+    }
+
+    // A run of cells ends at the first cell that is shared, which is then
+    // written as the tail.
+    void emit_list(value const &val)
+    {
+        std::size_t count = 1;
+        auto pos = &val.get<pair>().cdr;
+        for (; pos->is<pair>() && pos->use_count() == 1; pos = &pos->get<pair>().cdr)
+            ++count;
+        put(tag::list);
+        put_varint(count);
+        auto cell = &val;
+        for (std::size_t i = 0; i != count; ++i, cell = &cell->get<pair>().cdr)
+            emit(cell->get<pair>().car);
+        emit(*pos);
+    }
+
+    std::string out_;
+    std::unordered_map<symbol, std::size_t> symbols_;
+    std::unordered_map<void const *, std::size_t> objects_;
+    std::vector<value> shared_;
+};
+
+class decoder
+{
+public:
+    decoder(char const *first, char const *last)
+      : pos_(first), last_(last), depth_(0)
+    {}
+
+    virtual ~decoder() {}
+
+    value decode()
+    {
+        auto ret = read();
+        if (pos_ != last_)
+            fail("trailing bytes");
+        return ret;
+    }
+
+    // Calls fn with each element of a payload that is a proper list, so
+    // that a long list need not be built before it is used.
+    template <class Fn>
+    void decode_elements(Fn const &fn)
+    {
+        for (auto t = static_cast<tag>(get()); t != tag::nil; t = static_cast<tag>(get()))
+        {
+            if (t != tag::list)
+                fail("expected a list");
+            auto const count = get_count();
+            if (count == 0)
+                fail("empty list run");
+            for (std::size_t i = 0; i != count; ++i)
+                fn(read());
+        }
+        if (pos_ != last_)
+            fail("trailing bytes");
+    }
+
+protected:
+    // Reads what is not plain data, after its tag. Only images allow any.
+    virtual value read_extension(tag)
+    {
+        fail("unknown tag");
+    }
+
+    [[noreturn]] static void fail(char const *what)
+    {
+        throw corrupt_data(what);
+    }
+
+    unsigned char get()
+    {
+        if (pos_ == last_)
+            fail("unexpected end");
+        return static_cast<unsigned char>(*pos_++);
+    }
+
+    std::uint64_t get_varint()
+    {
+        std::uint64_t n = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            auto const byte = get();
+            n |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return n;
+        }
+        fail("varint too long");
+    }
+
+    // Every element takes at least one byte, so a count larger than what is
+    // left cannot be valid.
+    std::size_t get_count()
+    {
+        auto const n = get_varint();
+        if (n > static_cast<std::uint64_t>(last_ - pos_))
+            fail("count past end");
+        return static_cast<std::size_t>(n);
+    }
+
+    double get_double()
+    {
+        std::uint64_t bits = 0;
+        for (auto i = 0; i != 8; ++i)
+            bits |= static_cast<std::uint64_t>(get()) << (8 * i);
+        double d;
+        std::memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+
+    boost::string_view get_bytes()
+    {
+        auto const n = get_count();
+        auto const ret = boost::string_view(pos_, n);
+        pos_ += n;
+        return ret;
+    }
+
+    // Values are read recursively, so the nesting is limited before it can
+    // exhaust the stack.
+    value read()
+    {
+        if (depth_ == max_depth)
+            fail("nested too deeply");
+        ++depth_;
+        auto ret = read_tagged();
+        --depth_;
+        return ret;
+    }
+
+private:
+    value read_tagged()
+    {
+        // Only the value that immediately follows shared may claim its index.
+        auto const claim = claim_;
+        claim_ = boost::none;
+        auto const t = static_cast<tag>(get());
+        switch (t)
+        {
+        case tag::nil:
+            return value();
+        case tag::false_:
+            return value::make<bool_>(false);
+        case tag::true_:
+            return value::make<bool_>(true);
+        case tag::fixnum:
+            return value::make<number>(unzigzag(get_varint()));
+        case tag::flonum:
+            return value::make<flonum>(get_double());
+        case tag::bignum:
+        {
+            auto const negative = get() != 0;
+            auto const bytes = get_bytes();
+            if (bytes.empty() || bytes[0] == 0)
+                fail("bad bignum");
+            bigint n;
+            boost::multiprecision::import_bits(
+                n,
+                reinterpret_cast<unsigned char const *>(bytes.data()),
+                reinterpret_cast<unsigned char const *>(bytes.data() + bytes.size()),
+                8);
+            return make_integer(negative ? bigint(-n) : n);
+        }
+        case tag::string:
+            return value::make<string>(get_bytes().to_string());
+        case tag::symbol_def:
+            symbols_.emplace_back(get_bytes());
+            return value::make<atom>(symbols_.back());
+        case tag::symbol_ref:
+        {
+            auto const index = get_varint();
+            if (index >= symbols_.size())
+                fail("bad symbol index");
+            return value::make<atom>(symbols_[index]);
+        }
+        case tag::list:
+        {
+            auto const count = get_count();
+            if (count == 0)
+                fail("empty list run");
+            value head;
+            auto tail = &head;
+            for (std::size_t i = 0; i != count; ++i)
+            {
+                *tail = make_pair(value(), value());
+                tail->get<pair>().car = read();
+                tail = &tail->get<pair>().cdr;
+            }
+            *tail = read();
+            return head;
+        }
+        case tag::vector:
+        {
+            auto const count = get_count();
+            auto ret = value::make<vector>({});
+            if (claim)
+                objects_[*claim] = ret;
+            auto &elems = ret.get<vector>();
+            elems.reserve(count);
+            for (std::size_t i = 0; i != count; ++i)
+                elems.push_back(read());
+            return ret;
+        }
+        case tag::f64vector:
+        {
+            auto const count = get_count();
+            std::vector<double> elems;
+            elems.reserve(count);
+            for (std::size_t i = 0; i != count; ++i)
+                elems.push_back(get_double());
+            return value::make<f64vector>(std::move(elems));
+        }
+        case tag::s64vector:
+        {
+            auto const count = get_count();
+            std::vector<std::int64_t> elems;
+            elems.reserve(count);
+            for (std::size_t i = 0; i != count; ++i)
+                elems.push_back(unzigzag(get_varint()));
+            return value::make<s64vector>(std::move(elems));
+        }
+        case tag::hash_table:
+        {
+            auto const kind = get();
+            if (kind > static_cast<unsigned char>(equivalence::equal))
+                fail("bad hash table kind");
+            auto const count = get_count();
+            auto ret = value::make<hash_table>(hash_table_rep(static_cast<equivalence>(kind)));
+            if (claim)
+                objects_[*claim] = ret;
+            auto &table = ret.get<hash_table>();
+            for (std::size_t i = 0; i != count; ++i)
+            {
+                auto const key = read();
+                table.set(key, read());
+            }
+            return ret;
+        }
+        case tag::shared:
+        {
+            auto const index = objects_.size();
+            objects_.emplace_back();
+            claim_ = index;
+            auto ret = read();
+            objects_[index] = ret;
+            return ret;
+        }
+        case tag::backref:
+        {
+            auto const index = get_varint();
+            if (index >= objects_.size() || !objects_[index])
+                fail("bad object index");
+            return *objects_[index];
+        }
+        default:
+            return read_extension(t);
+        }
+    }
+
+    char const *pos_;
+    char const *last_;
+    std::vector<symbol> symbols_;
+    std::vector<boost::optional<value>> objects_;
+    boost::optional<std::size_t> claim_;
+    std::size_t depth_;
+};
+
+// Reads the payload of the next record, or returns none at the end of the
+// stream.
+inline boost::optional<std::string> read_record(std::istream &is)
+{
+    char header[sizeof(magic) + 1];
+    if (!is.read(header, sizeof(header)))
+    {
+        if (is.gcount() == 0)
+            return boost::none;
+        throw corrupt_data("truncated header");
+    }
+    if (!std::equal(magic, magic + sizeof(magic), header))
+        throw corrupt_data("bad magic");
+    if (static_cast<unsigned char>(header[sizeof(magic)]) != version)
+        throw corrupt_data("unsupported version");
+    std::uint64_t size = 0;
+    for (unsigned shift = 0;; shift += 7)
+    {
+        auto const byte = is.get();
+        if (byte == std::istream::traits_type::eof() || shift >= 64)
+            throw corrupt_data("truncated header");
+        size |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    std::string payload;
+    // Grow with the data actually read, so a corrupt length cannot make us
+    // allocate it all up front.
+    char chunk[64 * 1024];
+    while (payload.size() < size)
+    {
+        auto const want = std::min<std::uint64_t>(sizeof(chunk), size - payload.size());
+        if (!is.read(chunk, want))
+            throw corrupt_data("truncated payload");
+        payload.append(chunk, want);
+    }
+    return payload;
+}
+
+inline void write_record(std::ostream &os, std::string const &payload)
+{
+    std::string header(magic, sizeof(magic));
+    header.push_back(static_cast<char>(version));
+    put_varint(header, payload.size());
+    os.write(header.data(), header.size());
+    os.write(payload.data(), payload.size());
+}
+}
+
+inline void write_binary(std::ostream &os, value const &val)
+{
+    binary_detail::encoder enc;
+    binary_detail::write_record(os, enc.encode(val));
+}
+
+// Reads the next record, or returns none at the end of the stream.
+inline boost::optional<value> read_binary(std::istream &is)
+{
+    auto const payload = binary_detail::read_record(is);
+    if (!payload)
+        return boost::none;
+    return binary_detail::decoder(payload->data(), payload->data() + payload->size()).decode();
+}
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "./protocol.hpp"
+
+using namespace iolisp;
+
+int fail(std::string const &what)
+{
+    std::cerr << "iolisp-client: " << what << std::endl;
+    return 1;
+}
+
+int connect_to(std::string const &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    path.copy(addr.sun_path, path.size());
+    auto const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// iolisp-client [--latency] SOCKET script [args...]
+//
+// Runs script on a server started by iolisp --serve SOCKET, writing what it
+// writes and exiting with its status. --latency reports the time from
+// connecting to the status arriving on standard error.
+int main(int argc, char *argv[])
+{
+    auto first = argv + 1;
+    auto const last = argv + argc;
+    auto const latency = first != last && first[0] == std::string("--latency");
+    if (latency)
+        ++first;
+    if (last - first < 2)
+        return fail("usage: iolisp-client [--latency] SOCKET script [args...]");
+    auto const start = std::chrono::steady_clock::now();
+    auto const fd = connect_to(first[0]);
+    if (fd < 0)
+        return fail(std::string(first[0]) + ": " + std::strerror(errno));
+
+    // The server resolves paths against its own directory.
+    std::vector<std::string> request;
+    char resolved[PATH_MAX];
+    request.push_back(::realpath(first[1], resolved) ? resolved : first[1]);
+    request.insert(request.end(), first + 2, last);
+    if (!protocol::send_frame(fd, protocol::request, protocol::pack_strings(request)))
+        return fail("could not send the request");
+
+    char kind;
+    std::string payload;
+    while (protocol::receive_frame(fd, kind, payload))
+        if (kind == protocol::output)
+            std::cout.write(payload.data(), payload.size()).flush();
+        else if (kind == protocol::error_output)
+            std::cerr.write(payload.data(), payload.size());
+        else if (kind == protocol::status)
+        {
+            if (latency)
+                std::cerr
+                    << "iolisp-client: "
+                    << std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start).count()
+                    << " ms"
+                    << std::endl;
+            return std::atoi(payload.c_str());
+        }
+    return fail("the server closed the connection");
+}
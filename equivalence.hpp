@@ -0,0 +1,289 @@
+#ifndef IOLISP_EQUIVALENCE_HPP
+#define IOLISP_EQUIVALENCE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_view.hpp>
+#include "./number.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// The three ways values can be the same, from strictest to loosest, and a
+// hash for each that agrees with it: values that are the same always hash
+// alike. None of them throws.
+enum class equivalence
+{
+    // The same heap object, or the same immediate.
+    eq,
+    // Numbers of the same kind with the same value, strings with the same
+    // characters, and lists and vectors whose elements are eqv.
+    eqv,
+    // Also numbers of different kinds, or spelled out in strings, with the
+    // same value, and a string that spells out an integer or boolean.
+    equal
+};
+
+namespace equivalence_detail
+{
+// How many elements of lists and vectors, however nested, are hashed. Keys
+// that only differ further in hash alike.
+static constexpr std::size_t hashed_elements = 16;
+
+inline std::size_t hash_bits(double d)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    return boost::hash<std::uint64_t>()(bits);
+}
+
+inline std::size_t hash_text(boost::string_view text)
+{
+    return boost::hash_range(text.begin(), text.end());
+}
+
+inline std::size_t hash_eqv(value const &val, std::size_t &budget)
+{
+    std::size_t ret = 0;
+    if (val.is<number>())
+        return boost::hash<std::int64_t>()(val.get<number>());
+    else if (val.is<flonum>())
+        return hash_bits(val.get<flonum>());
+    else if (val.is<bignum>())
+    {
+        auto const &backend = val.get<bignum>().backend();
+        ret = boost::hash_range(backend.limbs(), backend.limbs() + backend.size());
+        boost::hash_combine(ret, backend.sign());
+    }
+    else if (is_text(val))
+        return hash_text(text_of(val));
+    else if (val.is<atom>())
+        return val.get<atom>().hash();
+    else if (val.is<pair>())
+    {
+        auto pos = &val;
+        for (; pos->is<pair>() && budget != 0; pos = &pos->get<pair>().cdr)
+        {
+            --budget;
+            boost::hash_combine(ret, hash_eqv(pos->get<pair>().car, budget));
+        }
+        if (!pos->is<pair>())
+            boost::hash_combine(ret, hash_eqv(*pos, budget));
+    }
+    else if (val.is<vector>())
+    {
+        auto const &elems = val.get<vector>();
+        ret = elems.size();
+        for (std::size_t i = 0; i != elems.size() && budget != 0; ++i)
+        {
+            --budget;
+            boost::hash_combine(ret, hash_eqv(elems[i], budget));
+        }
+    }
+    else if (val.is<f64vector>())
+    {
+        auto const &elems = val.get<f64vector>();
+        ret = elems.size();
+        for (std::size_t i = 0; i != elems.size() && budget != 0; ++i, --budget)
+            boost::hash_combine(ret, hash_bits(elems[i]));
+    }
+    else if (val.is<s64vector>())
+    {
+        auto const &elems = val.get<s64vector>();
+        ret = elems.size();
+        for (std::size_t i = 0; i != elems.size() && budget != 0; ++i, --budget)
+            boost::hash_combine(ret, elems[i]);
+    }
+    else
+        return val.identity_hash();
+    return ret;
+}
+
+// The pairs of vectors being compared, outermost first. Only a vector can
+// make a value contain itself. A pair met again inside itself is taken to
+// be eqv, since a difference between them would show up elsewhere along
+// the way; so cyclic vectors compare in finite time.
+class vector_pair_path
+{
+public:
+    vector_pair_path(void const *lhs, void const *rhs)
+      : cycle_(std::find(path().begin(), path().end(), std::make_pair(lhs, rhs)) != path().end())
+    {
+        if (!cycle_)
+            path().emplace_back(lhs, rhs);
+    }
+
+    ~vector_pair_path()
+    {
+        if (!cycle_)
+            path().pop_back();
+    }
+
+    vector_pair_path(vector_pair_path const &) = delete;
+    vector_pair_path &operator=(vector_pair_path const &) = delete;
+
+    bool cycle() const
+    {
+        return cycle_;
+    }
+
+private:
+    static std::vector<std::pair<void const *, void const *>> &path()
+    {
+        static thread_local std::vector<std::pair<void const *, void const *>> pairs;
+        return pairs;
+    }
+
+    bool cycle_;
+};
+
+// The text unpack<string> gives for val: its characters, the digits of an
+// integer, or True or False.
+inline bool text_form(value const &val, std::string &buf, boost::string_view &ret)
+{
+    if (is_text(val))
+        ret = text_of(val);
+    else if (is_integer(val))
+        ret = buf = integer_to_string(val);
+    else if (val.is<bool_>())
+        ret = val.get<bool_>() ? "True" : "False";
+    else
+        return false;
+    return true;
+}
+}
+
+// Flonums are eqv when their bits are, so a NaN is eqv to itself and 0.0
+// is not eqv to -0.0. Vectors that contain themselves are eqv when no
+// element reached through them differs. Values with no other rule are eqv
+// only to themselves.
+inline bool is_eqv(value const &first, value const &second)
+{
+    auto lhs = &first;
+    auto rhs = &second;
+    // Lists compare element by element. Only the cars recurse, so long
+    // lists are walked without growing the stack.
+    while (lhs->is<pair>() && rhs->is<pair>())
+    {
+        auto const &lhs_cell = lhs->get<pair>();
+        auto const &rhs_cell = rhs->get<pair>();
+        if (&lhs_cell == &rhs_cell)
+            return true;
+        if (!is_eqv(lhs_cell.car, rhs_cell.car))
+            return false;
+        lhs = &lhs_cell.cdr;
+        rhs = &rhs_cell.cdr;
+    }
+    if (lhs->identical(*rhs))
+        return true;
+    else if (lhs->is<vector>() && rhs->is<vector>())
+    {
+        auto const &lhs_elems = lhs->get<vector>();
+        auto const &rhs_elems = rhs->get<vector>();
+        if (lhs_elems.size() != rhs_elems.size())
+            return false;
+        equivalence_detail::vector_pair_path const path(&lhs_elems, &rhs_elems);
+        if (path.cycle())
+            return true;
+        for (std::size_t i = 0; i != lhs_elems.size(); ++i)
+            if (!is_eqv(lhs_elems[i], rhs_elems[i]))
+                return false;
+        return true;
+    }
+    else if (lhs->is<f64vector>() && rhs->is<f64vector>())
+    {
+        auto const &lhs_elems = lhs->get<f64vector>();
+        auto const &rhs_elems = rhs->get<f64vector>();
+        return lhs_elems.size() == rhs_elems.size() &&
+            std::memcmp(lhs_elems.data(), rhs_elems.data(), lhs_elems.size() * sizeof(double)) == 0;
+    }
+    else if (lhs->is<s64vector>() && rhs->is<s64vector>())
+        return lhs->get<s64vector>() == rhs->get<s64vector>();
+    else if (lhs->is<bignum>() && rhs->is<bignum>())
+        return lhs->get<bignum>() == rhs->get<bignum>();
+    else if (is_text(*lhs) && is_text(*rhs))
+        return text_of(*lhs) == text_of(*rhs);
+    return false;
+}
+
+// Numbers are compared by value, after the conversions arithmetic makes;
+// otherwise values are equal when unpack<string> gives both the same text,
+// or they are eqv.
+inline bool is_equal(value const &lhs, value const &rhs)
+{
+    if (lhs.is<number>() && rhs.is<number>())
+        return lhs.get<number>() == rhs.get<number>();
+    else if (lhs.identical(rhs))
+        return true;
+    if (auto const l = to_number(lhs))
+        if (auto const r = to_number(rhs))
+            if (!is_nan(*l) && !is_nan(*r) && compare(*l, *r) == 0)
+                return true;
+    if (is_text(lhs) || is_text(rhs))
+    {
+        std::string lhs_buf, rhs_buf;
+        boost::string_view lhs_text, rhs_text;
+        if (equivalence_detail::text_form(lhs, lhs_buf, lhs_text) &&
+            equivalence_detail::text_form(rhs, rhs_buf, rhs_text) &&
+            lhs_text == rhs_text)
+            return true;
+    }
+    return is_eqv(lhs, rhs);
+}
+
+inline bool is_equivalent(equivalence kind, value const &lhs, value const &rhs)
+{
+    switch (kind)
+    {
+    case equivalence::eq:
+        return lhs.identical(rhs);
+    case equivalence::eqv:
+        return is_eqv(lhs, rhs);
+    default:
+        return is_equal(lhs, rhs);
+    }
+}
+
+inline std::size_t hash_eqv(value const &val)
+{
+    auto budget = equivalence_detail::hashed_elements;
+    return equivalence_detail::hash_eqv(val, budget);
+}
+
+// Anything equal to a number converts to the same double, and -0.0 is equal
+// to 0.0; a string equal to a boolean has its text.
+inline std::size_t hash_equal(value const &val)
+{
+    if (auto const n = to_number(val))
+    {
+        auto const d = to_double(*n);
+        return equivalence_detail::hash_bits(d == 0 ? 0.0 : d);
+    }
+    else if (is_text(val))
+        return equivalence_detail::hash_text(text_of(val));
+    else if (val.is<bool_>())
+        return equivalence_detail::hash_text(val.get<bool_>() ? "True" : "False");
+    return hash_eqv(val);
+}
+
+inline std::size_t hash_value(equivalence kind, value const &val)
+{
+    switch (kind)
+    {
+    case equivalence::eq:
+        return val.identity_hash();
+    case equivalence::eqv:
+        return hash_eqv(val);
+    default:
+        return hash_equal(val);
+    }
+}
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef IOLISP_ERRORS_HPP
 #define IOLISP_ERRORS_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -76,6 +78,53 @@ public:
     {}
 };
 
+class division_by_zero
+  : public error
+{
+public:
+    division_by_zero()
+      : error("Division by zero")
+    {}
+};
+
+// A result that must be stored in 64 bits, such as an s64vector element,
+// did not fit.
+class integer_overflow
+  : public error
+{
+public:
+    explicit integer_overflow(std::string const &where)
+      : error("Integer overflow in " + where)
+    {}
+};
+
+class index_out_of_range
+  : public error
+{
+public:
+    index_out_of_range(std::int64_t index, std::size_t size)
+      : error("Index out of range: " + std::to_string(index) + " (size " + std::to_string(size) + ")")
+    {}
+};
+
+class key_not_found
+  : public error
+{
+public:
+    explicit key_not_found(value const &key)
+      : error("Key not found: " + show(key))
+    {}
+};
+
+class corrupt_data
+  : public error
+{
+public:
+    explicit corrupt_data(std::string const &what)
+      : error("Corrupt binary data: " + what)
+    {}
+};
+
 class unbound_variable
   : public error
 {
@@ -2,10 +2,13 @@
 #define IOLISP_EVAL_HPP
 
 #include <array>
+#include <atomic>
+#include <cstddef>
 #include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include <boost/range/adaptors.hpp>
 #include <boost/range/functions.hpp>
@@ -17,233 +20,678 @@ namespace iolisp
 {
 namespace eval_detail
 {
-inline bool is_bound(environment const &env, std::string const &var)
+struct lexical_address
 {
-    return env->find(var) != env->end();
+    std::size_t depth;
+    std::size_t slot;
+};
+
+// A call left by a node in tail position for execute_body to make.
+struct tail_call
+{
+    std::shared_ptr<lambda_syntax const> lambda;
+    environment env;
+};
+
+// A form after analysis. Special forms are recognised and variables are
+// resolved once, so running a node costs one virtual call plus its own work.
+class node
+{
+public:
+    virtual ~node() {}
+
+    // tail is non-null when this node is in tail position. A call to a
+    // function may then be stored there instead of being made.
+    virtual value run(environment const &env, tail_call *tail) const = 0;
+};
+
+using node_ptr = std::unique_ptr<node const>;
+
+struct lambda_syntax
+{
+    std::vector<symbol> parameters;
+    boost::optional<symbol> variadic_argument;
+    std::shared_ptr<scope> layout;
+    std::vector<node_ptr> body;
+};
+
+inline std::size_t add_slot(scope &sc, symbol const &var)
+{
+    auto const it = sc.slots.find(var);
+    if (it != sc.slots.end())
+        return it->second;
+    sc.names.push_back(var);
+    sc.slots.insert(it, {var, sc.names.size() - 1});
+    return sc.names.size() - 1;
+}
+
+// Variables that are not bound by any enclosing scope get an unbound slot in
+// the outermost one, so a later top-level define fills in the same slot.
+inline lexical_address resolve(std::shared_ptr<scope> const &sc, symbol const &var)
+{
+    std::size_t depth = 0;
+    for (auto s = sc.get(); ; s = s->parent.get(), ++depth)
+    {
+        auto const it = s->slots.find(var);
+        if (it != s->slots.end())
+            return {depth, it->second};
+        else if (!s->parent)
+            return {depth, add_slot(*s, var)};
+    }
+}
+
+inline frame &frame_at(environment const &env, std::size_t depth)
+{
+    auto f = env.get();
+    for (; depth != 0; --depth)
+        f = f->parent.get();
+    return *f;
+}
+
+inline boost::optional<value> &slot_at(frame &f, std::size_t slot)
+{
+    if (f.slots.size() <= slot)
+        f.slots.resize(f.layout->names.size());
+    return f.slots[slot];
+}
+
+inline bool is_bound(environment const &env, symbol const &var)
+{
+    for (auto f = env.get(); f; f = f->parent.get())
+    {
+        auto const it = f->layout->slots.find(var);
+        if (it != f->layout->slots.end() && it->second < f->slots.size() && f->slots[it->second])
+            return true;
+    }
+    return false;
 }
 
-inline value get_variable(environment const &env, std::string const &var)
+inline value get_variable(environment const &env, lexical_address const &addr)
 {
-    auto const it = env->find(var);
-    if (it != env->end())
-        return *(it->second);
-    throw unbound_variable("Getting an unbound variable: ", var);
+    auto &f = frame_at(env, addr.depth);
+    if (addr.slot < f.slots.size() && f.slots[addr.slot])
+        return *f.slots[addr.slot];
+    throw unbound_variable("Getting an unbound variable: ", f.layout->names[addr.slot].name());
 }
 
-inline value set_variable(environment const &env, std::string const &var, value const &val)
+inline value set_variable(environment const &env, lexical_address const &addr, value const &val)
 {
-    auto const it = env->find(var);
-    if (it != env->end())
+    auto &f = frame_at(env, addr.depth);
+    if (addr.slot < f.slots.size() && f.slots[addr.slot])
     {
-        *(it->second) = val;
+        heap::exclusive_section const section(heap::is_shared(f));
+        *f.slots[addr.slot] = val;
         return val;
     }
-    throw unbound_variable("Setting an unbound variable: ", var);
+    throw unbound_variable("Setting an unbound variable: ", f.layout->names[addr.slot].name());
+}
+
+inline value define_variable(frame &f, std::size_t slot, value const &val)
+{
+    heap::exclusive_section const section(heap::is_shared(f));
+    slot_at(f, slot) = val;
+    return val;
+}
+
+// Scopes are shared by every thread, so adding to one stops the others.
+inline value define_variable(environment const &env, symbol const &var, value const &val)
+{
+    heap::exclusive_section const section;
+    return define_variable(*env, add_slot(*env->layout, var), val);
 }
 
 inline value define_variable(environment const &env, std::string const &var, value const &val)
 {
-    auto const it = env->find(var);
-    if (it != env->end())
+    return define_variable(env, symbol(var), val);
+}
+
+struct special_forms
+{
+    symbol quote, if_, set, define, lambda, load;
+
+    static special_forms const &get()
     {
-        *(it->second) = val;
-        return val;
+        static special_forms const forms{
+            symbol("quote"),
+            symbol("if"),
+            symbol("set!"),
+            symbol("define"),
+            symbol("lambda"),
+            symbol("load")};
+        return forms;
     }
-    else
+};
+
+inline bool is_special_form(std::vector<value> const &vec, symbol const &name)
+{
+    return !vec.empty() && vec[0].is<atom>() && vec[0].get<atom>() == name;
+}
+
+// The elements of a proper list, for taking apart special forms.
+inline std::vector<value> form_elements(value const &val)
+{
+    auto const elems = list_elements(val);
+    return {boost::begin(elems), boost::end(elems)};
+}
+
+// The variadic parameter of a parameter list, if it is dotted.
+inline boost::optional<value> rest_parameter(value const &params)
+{
+    auto const &tail = list_tail(params);
+    if (tail.is<nil>())
+        return boost::none;
+    return tail;
+}
+
+inline void declare_definition(scope &sc, value const &form)
+{
+    if (!form.is<pair>() || !is_proper_list(form))
+        return;
+    auto const vec = form_elements(form);
+    if (!is_special_form(vec, special_forms::get().define))
+        return;
+    else if (vec.size() == 3 && vec[1].is<atom>())
+        add_slot(sc, vec[1].get<atom>());
+    else if (vec.size() >= 2 && vec[1].is<pair>() && vec[1].get<pair>().car.is<atom>())
+        add_slot(sc, vec[1].get<pair>().car.get<atom>());
+}
+
+template <class Args>
+inline environment bind_arguments(value::function_rep const &rep, Args const &args)
+{
+    if (rep.parameters.size() != boost::size(args) && !rep.variadic_argument)
+        throw wrong_number_of_arguments(rep.parameters.size(), args);
+    auto const env = make_frame(rep.body->layout, rep.closure);
+    std::size_t slot = 0;
+    auto it = boost::begin(args);
+    for (; slot != rep.parameters.size() && it != boost::end(args); ++slot, ++it)
+        env->slots[slot] = *it;
+    if (rep.variadic_argument)
+        env->slots[rep.parameters.size()] = make_list(it, boost::end(args));
+    return env;
+}
+
+// Runs a function body. Calls in tail position (the last form of a body and
+// either branch of an if) hand back the callee's body and frame, which are
+// run here instead of recursing, so tail-recursive loops use constant stack.
+inline value execute_body(std::shared_ptr<lambda_syntax const> lambda, environment env)
+{
+    tail_call tail;
+    while (true)
     {
-        env->insert(it, {var, std::make_shared<value>(val)});
-        return val;
+        heap::current().maybe_collect();
+        auto const &body = lambda->body;
+        if (body.empty())
+            return value();
+        for (auto it = body.begin(); it + 1 != body.end(); ++it)
+            (*it)->run(env, nullptr);
+        auto ret = body.back()->run(env, &tail);
+        if (!tail.lambda)
+            return ret;
+        lambda = std::move(tail.lambda);
+        env = std::move(tail.env);
     }
 }
+}
+
+value eval(environment const &env, value const &val);
 
-template <class Parameters, class Body>
-inline value make_function(
-    Parameters const &params,
-    boost::optional<value> const &varargs,
-    Body const &body,
-    environment const &env)
+namespace eval_detail
+{
+inline value call_primitive(value::primitive_rep const &prim, arguments args)
 {
-    auto const param_strs = params | boost::adaptors::transformed(&show);
-    return value::make<function>({
-        {boost::begin(param_strs), boost::end(param_strs)},
-        varargs ? boost::make_optional(show(*varargs)) : boost::none,
-        {boost::begin(body), boost::end(body)},
-        env});
+    if (prim.arity >= 0 && boost::size(args) != static_cast<std::size_t>(prim.arity))
+        throw wrong_number_of_arguments(prim.arity, args);
+    return prim.call(args);
+}
+
+inline value call_primitive(value::primitive_rep const &prim, std::vector<value> const &args)
+{
+    return call_primitive(prim, arguments(args.data(), args.data() + args.size()));
+}
+
+inline value call_primitive(value::primitive_rep const &prim, std::array<value, 1> const &args)
+{
+    return prim.call1 ? prim.call1(args[0]) : call_primitive(prim, arguments(args));
+}
+
+inline value call_primitive(value::primitive_rep const &prim, std::array<value, 2> const &args)
+{
+    return prim.call2 ? prim.call2(args[0], args[1]) : call_primitive(prim, arguments(args));
 }
 }
-value eval(environment const &envm, value const &val);
 
 template <class Args>
 inline value apply(value const &func, Args const &args)
 {
     if (func.is<primitive_function>())
-        return func.get<primitive_function>()(args);
+        return eval_detail::call_primitive(func.get<primitive_function>(), args);
     else if (func.is<io_function>())
-        return func.get<io_function>()(args);
+        return eval_detail::call_primitive(func.get<io_function>(), args);
     else if (func.is<function>())
     {
         auto const &rep = func.get<function>();
-        if (rep.parameters.size() != boost::size(args) && !rep.variadic_argument)
-            throw wrong_number_of_arguments(rep.parameters.size(), args);
-        else
+        return eval_detail::execute_body(rep.body, eval_detail::bind_arguments(rep, args));
+    }
+    throw not_function("Unrecognized primitive function args", show(func));
+}
+
+// Calls fn with each datum in the file as soon as it has been read.
+void load(std::string const &filename, std::function<void (value const &)> const &fn);
+
+namespace eval_detail
+{
+class constant_node
+  : public node
+{
+public:
+    explicit constant_node(value const &datum)
+      : datum_(datum)
+    {}
+
+    value run(environment const &, tail_call *) const override
+    {
+        return datum_;
+    }
+
+private:
+    value datum_;
+};
+
+class local_variable_node
+  : public node
+{
+public:
+    explicit local_variable_node(std::size_t slot)
+      : slot_(slot)
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        if (slot_ < env->slots.size() && env->slots[slot_])
+            return *env->slots[slot_];
+        return get_variable(env, {0, slot_});
+    }
+
+private:
+    std::size_t slot_;
+};
+
+class variable_node
+  : public node
+{
+public:
+    explicit variable_node(lexical_address const &address)
+      : address_(address)
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        return get_variable(env, address_);
+    }
+
+private:
+    lexical_address address_;
+};
+
+inline node_ptr make_variable(lexical_address const &address)
+{
+    if (address.depth == 0)
+        return node_ptr(new local_variable_node(address.slot));
+    return node_ptr(new variable_node(address));
+}
+
+class assignment_node
+  : public node
+{
+public:
+    assignment_node(lexical_address const &address, node_ptr form)
+      : address_(address), form_(std::move(form))
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        return set_variable(env, address_, form_->run(env, nullptr));
+    }
+
+private:
+    lexical_address address_;
+    node_ptr form_;
+};
+
+class definition_node
+  : public node
+{
+public:
+    definition_node(std::size_t slot, node_ptr form)
+      : slot_(slot), form_(std::move(form))
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        return define_variable(*env, slot_, form_->run(env, nullptr));
+    }
+
+private:
+    std::size_t slot_;
+    node_ptr form_;
+};
+
+class conditional_node
+  : public node
+{
+public:
+    conditional_node(node_ptr pred, node_ptr conseq, node_ptr alt)
+      : pred_(std::move(pred)), conseq_(std::move(conseq)), alt_(std::move(alt))
+    {}
+
+    value run(environment const &env, tail_call *tail) const override
+    {
+        auto const res = pred_->run(env, nullptr);
+        return res.is<bool_>() && !res.get<bool_>() ?
+            alt_->run(env, tail) :
+            conseq_->run(env, tail);
+    }
+
+private:
+    node_ptr pred_, conseq_, alt_;
+};
+
+class abstraction_node
+  : public node
+{
+public:
+    explicit abstraction_node(std::shared_ptr<lambda_syntax const> const &lambda)
+      : lambda_(lambda)
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        return value::make<function>({
+            lambda_->parameters,
+            lambda_->variadic_argument,
+            lambda_,
+            env});
+    }
+
+private:
+    std::shared_ptr<lambda_syntax const> lambda_;
+};
+
+class loading_node
+  : public node
+{
+public:
+    explicit loading_node(std::string const &filename)
+      : filename_(filename)
+    {}
+
+    value run(environment const &env, tail_call *) const override
+    {
+        // Loaded forms are analysed after the enclosing body was, so they
+        // are evaluated at top level where their definitions are visible.
+        auto global = env;
+        while (global->parent)
+            global = global->parent;
+        value ret;
+        load(filename_, [&](value const &expr)
+            {
+                ret = eval(global, expr);
+            });
+        return ret;
+    }
+
+private:
+    std::string filename_;
+};
+
+inline void size_arguments(std::vector<value> &args, std::size_t n)
+{
+    args.resize(n);
+}
+
+template <std::size_t N>
+inline void size_arguments(std::array<value, N> &, std::size_t)
+{}
+
+// Args is std::vector<value> in general. Calls with one or two arguments use
+// a std::array instead, so they allocate nothing and reach a primitive's
+// call1 or call2 entry point directly.
+template <class Args>
+class application_node
+  : public node
+{
+public:
+    application_node(node_ptr func, std::vector<node_ptr> args)
+      : func_(std::move(func)), args_(std::move(args))
+    {}
+
+    value run(environment const &env, tail_call *tail) const override
+    {
+        auto const func = func_->run(env, nullptr);
+        Args args;
+        size_arguments(args, args_.size());
+        for (std::size_t i = 0; i != args_.size(); ++i)
+            args[i] = args_[i]->run(env, nullptr);
+        if (tail && func.is<function>())
         {
-            auto const closure =
-                std::make_shared<std::map<std::string, std::shared_ptr<value>>>(*rep.closure);
-            auto it2 = boost::begin(args);
-            for (
-                auto it1 = rep.parameters.begin();
-                it1 != rep.parameters.end() && it2 != boost::end(args);
-                ++it1, ++it2)
-                (*closure)[*it1] = std::make_shared<value>(*it2);
-            if (rep.variadic_argument)
-                (*closure)[*rep.variadic_argument] =
-                    std::make_shared<value>(value::make<list>({it2, boost::end(args)}));
-            value ret;
-            for (auto const &val : rep.body)
-                ret = eval(closure, val);
-            return ret;
+            auto const &rep = func.get<function>();
+            tail->env = bind_arguments(rep, args);
+            tail->lambda = rep.body;
+            return value();
         }
+        return apply(func, args);
+    }
+
+private:
+    node_ptr func_;
+    std::vector<node_ptr> args_;
+};
+
+inline node_ptr make_application(node_ptr func, std::vector<node_ptr> args)
+{
+    switch (args.size())
+    {
+    case 1:
+        return node_ptr(new application_node<std::array<value, 1>>(std::move(func), std::move(args)));
+    case 2:
+        return node_ptr(new application_node<std::array<value, 2>>(std::move(func), std::move(args)));
+    default:
+        return node_ptr(new application_node<std::vector<value>>(std::move(func), std::move(args)));
     }
-    throw not_function("Unrecognized primitive function args", show(func));
 }
 
-std::vector<value> load(std::string const &filename);
+node_ptr analyze(value const &val, std::shared_ptr<scope> const &sc);
 
-inline value eval(environment const &env, value const &val)
+inline symbol param_name(value const &param)
+{
+    return param.is<atom>() ? param.get<atom>() : symbol(show(param));
+}
+
+// The body of a lambda restored from an image, which is analysed the first
+// time it runs, so that restoring an image does not pay for analysing
+// functions the program never calls.
+class deferred_body_node
+  : public node
 {
+public:
+    deferred_body_node(value const &body, std::shared_ptr<scope> const &layout)
+      : body_(body), layout_(layout)
+    {}
+
+    value run(environment const &env, tail_call *tail) const override
+    {
+        if (!analysed_.load(std::memory_order_acquire))
+        {
+            heap::exclusive_section const section;
+            if (!analysed_.load(std::memory_order_relaxed))
+            {
+                for (auto const &form : list_elements(body_))
+                    forms_.push_back(analyze(form, layout_));
+                analysed_.store(true, std::memory_order_release);
+            }
+        }
+        if (forms_.empty())
+            return value();
+        for (auto it = forms_.begin(); it + 1 != forms_.end(); ++it)
+            (*it)->run(env, nullptr);
+        return forms_.back()->run(env, tail);
+    }
+
+private:
+    value body_;
+    std::shared_ptr<scope> layout_;
+    mutable std::atomic<bool> analysed_{false};
+    mutable std::vector<node_ptr> forms_;
+};
+
+// source is (parameters . body), where the parameters are a list, a dotted
+// list or a single symbol that takes every argument. A deferred body is
+// analysed when it first runs; analysing it may still add slots to the
+// lambda's scope, so no frame for the scope may exist before then.
+inline std::shared_ptr<lambda_syntax const> analyze_lambda(
+    value const &source,
+    std::shared_ptr<scope> const &sc,
+    bool deferred = false)
+{
+    auto const &params = source.get<pair>().car;
+    auto const lambda = std::make_shared<lambda_syntax>();
+    lambda->layout = std::make_shared<scope>();
+    lambda->layout->parent = sc;
+    lambda->layout->source = source;
+    // Parameters always occupy the first slots, in order, so that apply can
+    // bind them positionally.
+    auto &layout = *lambda->layout;
+    for (auto const &param : list_elements(params))
+    {
+        lambda->parameters.push_back(param_name(param));
+        layout.names.push_back(lambda->parameters.back());
+        layout.slots[lambda->parameters.back()] = layout.names.size() - 1;
+    }
+    auto const varargs = params.is<atom>() ? boost::make_optional(params) : rest_parameter(params);
+    if (varargs)
+    {
+        lambda->variadic_argument = param_name(*varargs);
+        layout.names.push_back(*lambda->variadic_argument);
+        layout.slots[*lambda->variadic_argument] = layout.names.size() - 1;
+    }
+    // Internal defines are visible to the whole body, including the forms
+    // that precede them.
+    auto const body = form_elements(source.get<pair>().cdr);
+    for (auto const &form : body)
+        declare_definition(layout, form);
+    if (deferred)
+        lambda->body.push_back(node_ptr(new deferred_body_node(source.get<pair>().cdr, lambda->layout)));
+    else
+        for (auto const &form : body)
+            lambda->body.push_back(analyze(form, lambda->layout));
+    return lambda;
+}
+
+inline node_ptr make_abstraction(std::shared_ptr<lambda_syntax const> const &lambda)
+{
+    return node_ptr(new abstraction_node(lambda));
+}
+
+inline node_ptr analyze(value const &val, std::shared_ptr<scope> const &sc)
+{
+    auto const &forms = special_forms::get();
     // eval env val@(Number _) = val
-    if (val.is<number>())
-        return val;
     // eval env val@(String _) = val
-    else if (val.is<string>())
-        return val;
     // eval env val@(Bool _) = val
-    else if (val.is<bool_>())
-        return val;
+    // eval env val@(Vector _) = val
+    if (val.is<number>() || val.is<bignum>() || val.is<flonum>() || is_text(val) || val.is<bool_>() ||
+        val.is<vector>() || val.is<f64vector>() || val.is<s64vector>())
+        return node_ptr(new constant_node(val));
     // eval env val@(Atom var) = getVar env var
-    if (val.is<atom>())
-        return eval_detail::get_variable(env, val.get<atom>());
-    else if (val.is<list>())
+    else if (val.is<atom>())
+        return make_variable(resolve(sc, val.get<atom>()));
+    else if (val.is<pair>() && is_proper_list(val))
     {
-        auto const &vec = val.get<list>();
+        auto const vec = form_elements(val);
         // eval env (List [Atom "quote", val]) = val
-        if (vec.size() == 2 && vec[0].is<atom>() && vec[0].get<atom>() == "quote")
-            return vec[1];
+        if (vec.size() == 2 && is_special_form(vec, forms.quote))
+            return node_ptr(new constant_node(vec[1]));
         // eval env (List [Atom "if", pred, conseq, alt]) = case eval env pred of
         //   Bool False -> eval alt
         //   _          -> eval conseq
-        else if (vec.size() == 4 && vec[0].is<atom>() && vec[0].get<atom>() == "if")
+        else if (vec.size() == 4 && is_special_form(vec, forms.if_))
         {
-            auto const res = eval(env, vec[1]);
-            return res.is<bool_>() && !res.get<bool_>() ? eval(env, vec[3]) : eval(env, vec[2]);
+            auto pred = analyze(vec[1], sc);
+            auto conseq = analyze(vec[2], sc);
+            auto alt = analyze(vec[3], sc);
+            return node_ptr(new conditional_node(
+                std::move(pred),
+                std::move(conseq),
+                std::move(alt)));
         }
         // eval env (List [Atom "set!", Atom var, form]) = setVar env var (eval env form)
-        else if (
-            vec.size() == 3 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "set!" &&
-            vec[1].is<atom>())
-            return eval_detail::set_variable(env, vec[1].get<atom>(), eval(env, vec[2]));
+        else if (vec.size() == 3 && is_special_form(vec, forms.set) && vec[1].is<atom>())
+        {
+            auto const address = resolve(sc, vec[1].get<atom>());
+            return node_ptr(new assignment_node(address, analyze(vec[2], sc)));
+        }
         // eval env (List [Atom "define", Atom var, form]) = defineVar env var (eval env form)
-        else if (
-            vec.size() == 3 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "define" &&
-            vec[1].is<atom>())
-            return eval_detail::define_variable(env, vec[1].get<atom>(), eval(env, vec[2]));
-        // eval env (List (Atom "define" : List (Atom var : params) : body)) = ...
-        else if (
-            vec.size() >= 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "define" &&
-            vec[1].is<list>())
+        else if (vec.size() == 3 && is_special_form(vec, forms.define) && vec[1].is<atom>())
         {
-            auto const &var_params = vec[1].get<list>();
-            if (!var_params.empty() && var_params[0].is<atom>())
-                return eval_detail::define_variable(
-                    env,
-                    var_params[0].get<atom>(),
-                    eval_detail::make_function(
-                        var_params | boost::adaptors::sliced(1, var_params.size()),
-                        boost::none,
-                        vec | boost::adaptors::sliced(2, vec.size()),
-                        env));
+            auto const slot = add_slot(*sc, vec[1].get<atom>());
+            return node_ptr(new definition_node(slot, analyze(vec[2], sc)));
         }
-        // eval env (DottedList (Atom "define" : List (Atom var : params)) varargs : body)) = ...
-        else if (
-            vec.size() >= 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "define" &&
-            vec[1].is<dotted_list>())
+        // eval env (List (Atom "define" : List (Atom var : params) : body)) = ...
+        // eval env (List (Atom "define" : DottedList (Atom var : params) varargs : body)) = ...
+        else if (vec.size() >= 2 && is_special_form(vec, forms.define) && vec[1].is<pair>())
         {
-            auto const &var_params = vec[1].get<dotted_list>().first;
-            if (!var_params.empty() && var_params[0].is<atom>())
-                return eval_detail::define_variable(
-                    env,
-                    var_params[0].get<atom>(),
-                    eval_detail::make_function(
-                        var_params | boost::adaptors::sliced(1, var_params.size()),
-                        vec[1].get<dotted_list>().second,
-                        vec | boost::adaptors::sliced(2, vec.size()),
-                        env));
+            auto const var_params = form_elements(vec[1]);
+            if (var_params[0].is<atom>())
+            {
+                auto const slot = add_slot(*sc, var_params[0].get<atom>());
+                auto const &params_body = val.get<pair>().cdr.get<pair>();
+                return node_ptr(new definition_node(slot, make_abstraction(analyze_lambda(
+                    make_pair(params_body.car.get<pair>().cdr, params_body.cdr),
+                    sc))));
+            }
         }
         // eval env (List [Atom "lambda" : List params : body]) = ...
-        else if (
-            vec.size() >= 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "lambda" &&
-            vec[1].is<list>())
-            return eval_detail::make_function(
-                vec[1].get<list>(),
-                boost::none,
-                vec | boost::adaptors::sliced(2, vec.size()),
-                env);
         // eval env (List [Atom "lambda" : DottedList params varargs : body]) = ...
-        else if (
-            vec.size() >= 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "lambda" &&
-            vec[1].is<dotted_list>())
-            return eval_detail::make_function(
-                vec[1].get<dotted_list>().first,
-                vec[2].get<dotted_list>().second,
-                vec | boost::adaptors::sliced(2, vec.size()),
-                env);
         // eval env (List [Atom "lambda" : varargs@(Atom _) : body]) = ...
         else if (
-            vec.size() >= 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "lambda" &&
-            vec[1].is<atom>())
-            return eval_detail::make_function(
-                std::array<value, 0>(),
-                boost::none,
-                vec | boost::adaptors::sliced(2, vec.size()),
-                env);
+            vec.size() >= 2 && is_special_form(vec, forms.lambda) &&
+            (vec[1].is<nil>() || vec[1].is<pair>() || vec[1].is<atom>()))
+            return make_abstraction(analyze_lambda(val.get<pair>().cdr, sc));
         // eval env (List [Atom "load", String filename]) = ...
-        else if (
-            vec.size() == 2 &&
-            vec[0].is<atom>() && vec[0].get<atom>() == "load" &&
-            vec[1].is<string>())
-        {
-            auto const exprs = load(vec[1].get<string>());
-            value ret;
-            for (auto const &expr : exprs)
-                ret = eval(env, expr);
-            return ret;
-        }
+        else if (vec.size() == 2 && is_special_form(vec, forms.load) && vec[1].is<string>())
+            return node_ptr(new loading_node(vec[1].get<string>()));
         // eval env (List (function : args)) = ...
         else if (!vec.empty())
         {
-            struct eval_env
-            {
-                environment env;
-                value operator()(value const &val) const
-                {
-                    return eval(env, val);
-                }
-            };
-            return apply(
-                eval(env, vec[0]),
-                vec | boost::adaptors::sliced(1, vec.size()) 
-                    | boost::adaptors::transformed(eval_env{env}));
+            auto func = analyze(vec[0], sc);
+            std::vector<node_ptr> args;
+            for (auto const &elem : vec | boost::adaptors::sliced(1, vec.size()))
+                args.push_back(analyze(elem, sc));
+            return make_application(std::move(func), std::move(args));
         }
     }
     throw bad_special_form("Unrecognized special form", val);
 }
+}
+
+inline environment make_environment()
+{
+    return make_frame(std::make_shared<scope>(), nullptr);
+}
+
+// Analysing may add slots to scopes other threads are reading, so it stops
+// them; running the result does not.
+inline value eval(environment const &env, value const &val)
+{
+    heap::current().maybe_collect();
+    eval_detail::node_ptr node;
+    {
+        heap::exclusive_section const section;
+        node = eval_detail::analyze(val, env->layout);
+    }
+    return node->run(env, nullptr);
+}
 
 using eval_detail::define_variable;
 }
@@ -0,0 +1,93 @@
+#ifndef IOLISP_FUTURE_HPP
+#define IOLISP_FUTURE_HPP
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <utility>
+#include "./errors.hpp"
+#include "./heap.hpp"
+#include "./thread_pool.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// The computation behind a future value, run on the thread pool. Once it is
+// done it holds the result, or what the computation threw.
+class future_rep
+  : public task
+{
+public:
+    explicit future_rep(std::function<value ()> fn)
+      : fn_(std::move(fn))
+    {}
+
+    // Waits for the result, rethrowing what the computation threw.
+    value const &touch()
+    {
+        thread_pool::get().wait(*this);
+        if (error_)
+            std::rethrow_exception(error_);
+        return result_;
+    }
+
+    // Until it is done, the pool holds what the computation needs, so it
+    // only reports the result.
+    void trace(heap_visitor &visitor) const
+    {
+        if (done())
+            result_.trace(visitor);
+    }
+
+    void clear()
+    {
+        if (done())
+            result_ = value();
+    }
+
+protected:
+    void execute() override
+    {
+        try
+        {
+            result_ = fn_();
+        }
+        catch (...)
+        {
+            error_ = std::current_exception();
+        }
+        fn_ = nullptr;
+    }
+
+    void drop() override
+    {
+        error_ = std::make_exception_ptr(error("Future dropped when its job ended"));
+        fn_ = nullptr;
+    }
+
+private:
+    std::function<value ()> fn_;
+    value result_;
+    std::exception_ptr error_;
+};
+
+inline void trace_children(std::shared_ptr<future_rep> const &rep, heap_visitor &visitor)
+{
+    rep->trace(visitor);
+}
+
+inline void clear_children(std::shared_ptr<future_rep> &rep)
+{
+    rep->clear();
+}
+
+// Starts fn on the thread pool.
+inline value make_future(std::function<value ()> fn)
+{
+    auto const rep = std::make_shared<future_rep>(std::move(fn));
+    thread_pool::get().submit(rep);
+    return value::make<future>(rep);
+}
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef IOLISP_HASH_TABLE_HPP
+#define IOLISP_HASH_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "./equivalence.hpp"
+#include "./heap.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// The table behind a hash table value. Entries live in one array of slots
+// with linear probing, and deleting shifts the entries after a slot back
+// into it instead of leaving a marker, so lookups never step over dead
+// slots. Keys are hashed when they are added; a key changed afterwards, such
+// as a vector key given to vector-set!, may not be found again.
+class hash_table_rep
+{
+public:
+    explicit hash_table_rep(equivalence kind)
+      : kind_(kind), count_(0)
+    {}
+
+    equivalence kind() const
+    {
+        return kind_;
+    }
+
+    std::size_t size() const
+    {
+        return count_;
+    }
+
+    std::size_t bytes() const
+    {
+        return slots_.capacity() * sizeof(slot);
+    }
+
+    value const *find(value const &key) const
+    {
+        if (count_ == 0)
+            return nullptr;
+        auto const pos = position(key, hash_of(key));
+        return slots_[pos].hash != 0 ? &slots_[pos].val : nullptr;
+    }
+
+    void set(value const &key, value const &val)
+    {
+        if ((count_ + 1) * 4 > slots_.size() * 3)
+            rehash(slots_.empty() ? 8 : slots_.size() * 2);
+        auto const hash = hash_of(key);
+        auto &s = slots_[position(key, hash)];
+        if (s.hash == 0)
+        {
+            s.hash = hash;
+            s.key = key;
+            ++count_;
+        }
+        s.val = val;
+    }
+
+    // Returns whether key was there.
+    bool erase(value const &key)
+    {
+        if (count_ == 0)
+            return false;
+        auto pos = position(key, hash_of(key));
+        if (slots_[pos].hash == 0)
+            return false;
+        auto const mask = slots_.size() - 1;
+        for (auto next = (pos + 1) & mask; slots_[next].hash != 0; next = (next + 1) & mask)
+        {
+            // An entry may fill the gap if it lies between its home slot and
+            // the entry's slot.
+            auto const home = slots_[next].hash & mask;
+            if (((next - home) & mask) >= ((next - pos) & mask))
+            {
+                slots_[pos] = std::move(slots_[next]);
+                pos = next;
+            }
+        }
+        slots_[pos] = slot();
+        --count_;
+        return true;
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        count_ = 0;
+    }
+
+    // Calls fn with each key and value, in no particular order. fn must not
+    // change the table.
+    template <class Fn>
+    void for_each(Fn const &fn) const
+    {
+        for (auto const &s : slots_)
+            if (s.hash != 0)
+                fn(s.key, s.val);
+    }
+
+private:
+    // A hash of 0 marks an empty slot.
+    struct slot
+    {
+        std::size_t hash = 0;
+        value key;
+        value val;
+    };
+
+    // Spreads the hash over the bits used as the index, since the hashes of
+    // small integers are the integers themselves.
+    std::size_t hash_of(value const &key) const
+    {
+        std::uint64_t h = hash_value(kind_, key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h != 0 ? static_cast<std::size_t>(h) : 1;
+    }
+
+    // The slot holding key, or the empty slot where it would go. The table
+    // is never full, so the search ends.
+    std::size_t position(value const &key, std::size_t hash) const
+    {
+        auto const mask = slots_.size() - 1;
+        auto pos = hash & mask;
+        for (; slots_[pos].hash != 0; pos = (pos + 1) & mask)
+            if (slots_[pos].hash == hash && is_equivalent(kind_, slots_[pos].key, key))
+                break;
+        return pos;
+    }
+
+    void rehash(std::size_t capacity)
+    {
+        std::vector<slot> old(capacity);
+        old.swap(slots_);
+        auto const mask = capacity - 1;
+        for (auto &s : old)
+        {
+            if (s.hash == 0)
+                continue;
+            auto pos = s.hash & mask;
+            while (slots_[pos].hash != 0)
+                pos = (pos + 1) & mask;
+            slots_[pos] = std::move(s);
+        }
+    }
+
+    equivalence kind_;
+    std::size_t count_;
+    std::vector<slot> slots_;
+};
+
+inline void trace_children(hash_table_rep const &table, heap_visitor &visitor)
+{
+    table.for_each(
+        [&](value const &key, value const &val)
+        {
+            key.trace(visitor);
+            val.trace(visitor);
+        });
+}
+
+inline void clear_children(hash_table_rep &table)
+{
+    table.clear();
+}
+
+inline std::size_t extra_bytes(hash_table_rep const &table)
+{
+    return table.bytes();
+}
+}
+
+#endif
@@ -0,0 +1,784 @@
+#ifndef IOLISP_HEAP_HPP
+#define IOLISP_HEAP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace iolisp
+{
+class heap;
+class heap_object;
+
+class heap_visitor
+{
+public:
+    virtual void visit(heap_object *obj) = 0;
+
+protected:
+    ~heap_visitor() {}
+};
+
+// Every value that lives outside a value, and every environment frame.
+// Objects are reference counted, so most are freed as soon as they are
+// dropped; the heap's collector reclaims the cycles that counting misses,
+// such as a function stored in the frame it closes over. Counts are only
+// changed atomically once other threads run Lisp code (see heap::shared).
+class heap_object
+{
+public:
+    heap_object();
+
+    heap_object(heap_object const &) = delete;
+    heap_object &operator=(heap_object const &) = delete;
+
+    virtual ~heap_object();
+
+    // Visits every heap object this one holds a counted reference to.
+    virtual void trace(heap_visitor &visitor) const = 0;
+
+    // Drops the references trace() reports. Only called on garbage, to
+    // break the cycles that keep it alive.
+    virtual void clear() = 0;
+
+    virtual std::size_t bytes() const = 0;
+
+    static void *operator new(std::size_t size);
+    static void operator delete(void *ptr, std::size_t size);
+
+    std::uint32_t use_count() const
+    {
+        return __atomic_load_n(&refs_, __ATOMIC_RELAXED);
+    }
+
+    void add_ref();
+
+    // Whether no other thread can reach this object: it was allocated on
+    // this thread since the thread last handed values to another one.
+    bool is_private() const;
+
+private:
+    friend class heap;
+
+    // Used by a heap's list head, which is never linked into a heap itself.
+    explicit heap_object(std::nullptr_t)
+      : refs_(1), gc_refs_(0), owner_(nullptr), prev_(nullptr), next_(nullptr), epoch_(0)
+    {}
+
+    // Plain until heap::shared() is set, then changed with atomic builtins.
+    std::uint32_t refs_;
+    std::uint32_t gc_refs_;
+    heap *owner_;
+    heap_object *prev_;
+    heap_object *next_;
+    std::uint32_t epoch_;
+};
+
+namespace heap_detail
+{
+// Small objects (pairs, frames, bignums and most strings) are carved from
+// large blocks and recycled through per-thread free lists, one per 16-byte
+// size class. Blocks are never returned, so an object may be freed on a
+// different thread from the one that allocated it. What a thread leaves
+// free when it exits goes to the next thread that runs out.
+class small_object_pool
+{
+public:
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t max_size = 128;
+
+    // Zero initialised, so reaching it costs no initialisation check.
+    static small_object_pool &local()
+    {
+        static thread_local small_object_pool pool;
+        return pool;
+    }
+
+    void *allocate(std::size_t size)
+    {
+        auto &head = free_[size_class(size)];
+        if (!head)
+            refill(size_class(size));
+        auto const chunk = head;
+        head = chunk->next;
+        return chunk;
+    }
+
+    void deallocate(void *ptr, std::size_t size)
+    {
+        auto const chunk = static_cast<free_chunk *>(ptr);
+        auto &head = free_[size_class(size)];
+        chunk->next = head;
+        head = chunk;
+    }
+
+private:
+    struct free_chunk
+    {
+        free_chunk *next;
+    };
+
+    static constexpr std::size_t block_size = 64 * 1024;
+
+    static std::size_t size_class(std::size_t size)
+    {
+        return (size - 1) / granularity;
+    }
+
+    struct orphans
+    {
+        std::mutex mutex;
+        free_chunk *free[max_size / granularity];
+    };
+
+    static orphans &orphaned()
+    {
+        static orphans o{};
+        return o;
+    }
+
+    struct exit_hook
+    {
+        ~exit_hook()
+        {
+            local().orphan();
+        }
+    };
+
+    void orphan()
+    {
+        auto &o = orphaned();
+        std::lock_guard<std::mutex> lock(o.mutex);
+        for (std::size_t cls = 0; cls != max_size / granularity; ++cls)
+            while (auto const chunk = free_[cls])
+            {
+                free_[cls] = chunk->next;
+                chunk->next = o.free[cls];
+                o.free[cls] = chunk;
+            }
+    }
+
+    void refill(std::size_t cls)
+    {
+        // Set up here rather than in local(), where it would cost a check
+        // on every allocation.
+        static thread_local exit_hook hook;
+        (void)hook;
+        {
+            auto &o = orphaned();
+            std::lock_guard<std::mutex> lock(o.mutex);
+            if (o.free[cls])
+            {
+                free_[cls] = o.free[cls];
+                o.free[cls] = nullptr;
+                return;
+            }
+        }
+        auto const size = (cls + 1) * granularity;
+        auto const block = static_cast<char *>(::operator new(block_size));
+        for (auto pos = block; pos + size <= block + block_size; pos += size)
+            deallocate(pos, size);
+    }
+
+    free_chunk *free_[max_size / granularity];
+};
+
+// Threads running Lisp code stop at safe points, where every live object is
+// owned by a counted reference, whenever one of them needs the rest out of
+// the way: to collect, or to change an object the others may be reading. A
+// thread only counts while it is inside, between enter and leave; one
+// blocked on something else, such as a task it waits for, leaves until it
+// returns.
+class world
+{
+public:
+    static world &get()
+    {
+        static world w;
+        return w;
+    }
+
+    // Whether a thread is waiting for the others to stop, or has stopped
+    // them. Zero initialised, so checking it costs no initialisation check.
+    static std::atomic<bool> &stopping()
+    {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    // Nesting of exclusive sections on this thread. A thread inside one
+    // neither stops for, nor waits on, anyone else.
+    static unsigned &depth()
+    {
+        static thread_local unsigned n = 0;
+        return n;
+    }
+
+    // Whether this thread is inside.
+    static bool &inside()
+    {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    // This thread stops running Lisp code.
+    void leave()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --running_;
+        inside() = false;
+        changed_.notify_all();
+    }
+
+    // This thread runs Lisp code, once no one else holds the world.
+    void enter()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return !stopped_; });
+        ++running_;
+        inside() = true;
+    }
+
+    void safe_point()
+    {
+        leave();
+        enter();
+    }
+
+    // Waits until every other thread has left.
+    void stop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (stopped_)
+        {
+            --running_;
+            changed_.notify_all();
+            changed_.wait(lock, [this] { return !stopped_; });
+            ++running_;
+        }
+        stopped_ = true;
+        stopping().store(true, std::memory_order_relaxed);
+        changed_.wait(lock, [this] { return running_ == 1; });
+    }
+
+    void restart()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = false;
+        stopping().store(false, std::memory_order_relaxed);
+        changed_.notify_all();
+    }
+
+private:
+    world()
+      : running_(0), stopped_(false)
+    {}
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::size_t running_;
+    bool stopped_;
+};
+}
+
+struct gc_stats
+{
+    std::size_t collections;
+    std::size_t live_objects;
+    std::size_t live_bytes;
+    std::size_t freed_objects;
+    std::chrono::microseconds last_pause;
+    std::chrono::microseconds max_pause;
+    std::chrono::microseconds total_pause;
+};
+
+// Tracks every heap object allocated on a thread, or by an interpreter,
+// and collects the unreachable cycles among them. Once shared(), a
+// collection covers every heap, since objects then move between threads.
+//
+// There is no root set to enumerate. References from frames and values
+// that are themselves heap objects are subtracted from each object's count;
+// whatever count is left comes from outside the heaps collected (an
+// interpreter's global environment, values on the C++ stack, constants in
+// analysed code, objects of other heaps), and those objects are the roots.
+// Anything not reachable from them is garbage.
+//
+// Until shared() is set each thread only touches the objects of its own
+// heaps. After that an object another thread may be reading is only
+// changed inside an exclusive_section, which waits for every other thread
+// to reach a safe point, and so is a collection. Objects a thread allocated
+// since it last handed values to another (see publish) are private, and
+// are changed without stopping anyone.
+//
+// Only the owning thread links and unlinks the objects of a heap, so none of
+// that takes a lock. An object whose last reference is dropped on another
+// thread is queued for the owner, which frees it at its next safe point.
+class heap
+{
+public:
+    heap()
+      : allocations_(0), threshold_(min_threshold), epoch_(1), has_remote_(false), stats_()
+    {
+        // What every heap shares is constructed first, so it outlives them.
+        heap_detail::world::get();
+        sentinel_.prev_ = sentinel_.next_ = &sentinel_;
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+
+    heap(heap const &) = delete;
+    heap &operator=(heap const &) = delete;
+
+    // Objects that outlive their heap are left unlinked and without an
+    // owner, so whichever thread drops them frees them.
+    ~heap()
+    {
+        // Other threads may still be dropping these objects.
+        exclusive_section const section;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            registry().erase(std::find(registry().begin(), registry().end(), this));
+        }
+        while (has_remote_.load(std::memory_order_relaxed))
+            free_remote();
+        for (auto obj = sentinel_.next_; obj != &sentinel_;)
+        {
+            auto const next = obj->next_;
+            obj->owner_ = nullptr;
+            obj->prev_ = obj->next_ = nullptr;
+            obj = next;
+        }
+        sentinel_.prev_ = sentinel_.next_ = nullptr;
+    }
+
+    static heap *&current_pointer()
+    {
+        static heap global;
+        static thread_local heap *current = &global;
+        return current;
+    }
+
+    static heap &current()
+    {
+        return *current_pointer();
+    }
+
+    // Whether values may move between threads. Once set it stays set.
+    static bool shared()
+    {
+        return shared_flag().load(std::memory_order_relaxed);
+    }
+
+    // Called before starting threads that run Lisp code on values of this
+    // one. Those threads see the flag through whatever starts them, and
+    // the values of other threads never reach them before those threads
+    // see it too.
+    static void share()
+    {
+        current().publish();
+        shared_flag().store(true, std::memory_order_relaxed);
+    }
+
+    // Whether changing obj needs an exclusive_section.
+    static bool is_shared(heap_object const &obj)
+    {
+        return shared() && !obj.is_private();
+    }
+
+    // A thread joins the threads that run Lisp code while one of these
+    // lives, unless it already has: a pool worker while it runs a task, an
+    // interpreter's caller while it evaluates.
+    class running_section
+    {
+    public:
+        explicit running_section(bool needed = true)
+          : needed_(needed && !heap_detail::world::inside())
+        {
+            if (needed_)
+                heap_detail::world::get().enter();
+        }
+
+        running_section(running_section const &) = delete;
+        running_section &operator=(running_section const &) = delete;
+
+        ~running_section()
+        {
+            if (needed_)
+                heap_detail::world::get().leave();
+        }
+
+    private:
+        bool needed_;
+    };
+
+    // Stops every other thread for as long as it lives, when needed. Values
+    // stored while it lives may now be reached by others, so everything
+    // this thread allocated stops being private.
+    class exclusive_section
+    {
+    public:
+        explicit exclusive_section(bool needed = shared())
+          : needed_(needed), running_(needed)
+        {
+            if (needed_ && heap_detail::world::depth()++ == 0)
+                heap_detail::world::get().stop();
+        }
+
+        exclusive_section(exclusive_section const &) = delete;
+        exclusive_section &operator=(exclusive_section const &) = delete;
+
+        ~exclusive_section()
+        {
+            if (!needed_)
+                return;
+            current().publish();
+            if (--heap_detail::world::depth() == 0)
+                heap_detail::world::get().restart();
+        }
+
+    private:
+        bool needed_;
+        running_section running_;
+    };
+
+    // Marks a thread that runs no Lisp code while it lives, such as one
+    // waiting for another thread, so that no one has to wait for it in
+    // turn.
+    class blocking_section
+    {
+    public:
+        blocking_section()
+          : needed_(shared() && heap_detail::world::depth() == 0 && heap_detail::world::inside())
+        {
+            if (needed_)
+                heap_detail::world::get().leave();
+        }
+
+        blocking_section(blocking_section const &) = delete;
+        blocking_section &operator=(blocking_section const &) = delete;
+
+        ~blocking_section()
+        {
+            if (needed_)
+                heap_detail::world::get().enter();
+        }
+
+    private:
+        bool needed_;
+    };
+
+    // Makes everything allocated here so far reachable by other threads, so
+    // none of it is private any more. Called whenever values are handed to
+    // another thread.
+    void publish()
+    {
+        if (++epoch_ != 0)
+            return;
+        // Stamps from before the count wrapped could match again.
+        for (auto obj = sentinel_.next_; obj != &sentinel_; obj = obj->next_)
+            obj->epoch_ = 0;
+        epoch_ = 1;
+    }
+
+    // Called at points where every live object is fully constructed and
+    // owned by a counted reference.
+    void maybe_collect()
+    {
+        if (heap_detail::world::stopping().load(std::memory_order_relaxed) &&
+            heap_detail::world::depth() == 0)
+            heap_detail::world::get().safe_point();
+        if (has_remote_.load(std::memory_order_relaxed))
+            free_remote();
+        if (allocations_ >= threshold_)
+            collect();
+    }
+
+    // Collects the objects of this heap, or of every heap once shared().
+    void collect()
+    {
+        exclusive_section const section;
+        std::unique_lock<std::mutex> lock(registry_mutex(), std::defer_lock);
+        std::vector<heap *> heaps(1, this);
+        if (shared())
+        {
+            lock.lock();
+            heaps = registry();
+        }
+        auto const start = std::chrono::steady_clock::now();
+
+        // Queued objects have no references left, and would look like
+        // garbage held by nothing.
+        for (auto h : heaps)
+            h->free_remote();
+        for_each_object(heaps, [](heap_object *obj) { obj->gc_refs_ = obj->use_count(); });
+        subtract_visitor subtract;
+        for_each_object(heaps, [&](heap_object *obj) { obj->trace(subtract); });
+
+        mark_visitor mark;
+        for_each_object(heaps, [&](heap_object *obj)
+            {
+                if (obj->gc_refs_ != 0)
+                    mark.stack.push_back(obj);
+            });
+        while (!mark.stack.empty())
+        {
+            auto const obj = mark.stack.back();
+            mark.stack.pop_back();
+            obj->trace(mark);
+        }
+
+        std::vector<heap_object *> garbage;
+        std::size_t live_objects = 0;
+        std::size_t live_bytes = 0;
+        for_each_object(heaps, [&](heap_object *obj)
+            {
+                if (obj->gc_refs_ == 0)
+                    garbage.push_back(obj);
+                else
+                {
+                    ++live_objects;
+                    live_bytes += obj->bytes();
+                }
+            });
+        // Hold every garbage object while the cycles are broken, so none is
+        // freed while another still points at it.
+        for (auto obj : garbage)
+            obj->add_ref();
+        for (auto obj : garbage)
+            obj->clear();
+        for (auto obj : garbage)
+            release(obj);
+
+        auto const pause = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        for (auto h : heaps)
+        {
+            h->allocations_ = 0;
+            h->threshold_ = live_objects > min_threshold ? live_objects : min_threshold;
+            auto &stats = h->stats_;
+            ++stats.collections;
+            stats.live_objects = live_objects;
+            stats.live_bytes = live_bytes;
+            stats.freed_objects += garbage.size();
+            stats.last_pause = pause;
+            if (stats.max_pause < pause)
+                stats.max_pause = pause;
+            stats.total_pause += pause;
+            if (h->hook_)
+                h->hook_(stats);
+        }
+    }
+
+    // Counts every collection that covered this heap.
+    gc_stats const &stats() const
+    {
+        return stats_;
+    }
+
+    // Called with the updated statistics after every collection that
+    // covers this heap.
+    void set_collection_hook(std::function<void (gc_stats const &)> hook)
+    {
+        hook_ = std::move(hook);
+    }
+
+    static void release(heap_object *obj)
+    {
+        if (!shared())
+        {
+            if (--obj->refs_ == 0)
+                delete obj;
+        }
+        else if (__atomic_sub_fetch(&obj->refs_, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            // Inside an exclusive_section the owner is stopped, so this
+            // thread may unlink the object itself.
+            if (obj->owner_ && obj->owner_ != current_pointer() &&
+                heap_detail::world::depth() == 0)
+                obj->owner_->free_later(obj);
+            else
+                delete obj;
+        }
+    }
+
+private:
+    friend class heap_object;
+
+    static constexpr std::size_t min_threshold = 100000;
+
+    // Zero initialised, so checking it costs no initialisation check.
+    static std::atomic<bool> &shared_flag()
+    {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    static std::vector<heap *> &registry()
+    {
+        static std::vector<heap *> heaps;
+        return heaps;
+    }
+
+    static std::mutex &registry_mutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    // Only called with every other thread that uses these heaps stopped.
+    template <class Fn>
+    static void for_each_object(std::vector<heap *> const &heaps, Fn const &fn)
+    {
+        for (auto h : heaps)
+            for (auto obj = h->sentinel_.next_; obj != &h->sentinel_; obj = obj->next_)
+                fn(obj);
+    }
+
+    void free_later(heap_object *obj)
+    {
+        std::lock_guard<std::mutex> lock(remote_mutex_);
+        remote_.push_back(obj);
+        has_remote_.store(true, std::memory_order_relaxed);
+    }
+
+    // Called by the owner, or with the owner stopped.
+    void free_remote()
+    {
+        std::vector<heap_object *> objs;
+        {
+            std::lock_guard<std::mutex> lock(remote_mutex_);
+            objs.swap(remote_);
+            has_remote_.store(false, std::memory_order_relaxed);
+        }
+        for (auto obj : objs)
+            delete obj;
+    }
+
+    struct subtract_visitor
+      : heap_visitor
+    {
+        void visit(heap_object *obj) override
+        {
+            --obj->gc_refs_;
+        }
+    };
+
+    struct mark_visitor
+      : heap_visitor
+    {
+        void visit(heap_object *obj) override
+        {
+            if (obj->gc_refs_ == 0)
+            {
+                obj->gc_refs_ = 1;
+                stack.push_back(obj);
+            }
+        }
+
+        std::vector<heap_object *> stack;
+    };
+
+    class sentinel_object
+      : public heap_object
+    {
+    public:
+        sentinel_object()
+          : heap_object(nullptr)
+        {}
+
+        void trace(heap_visitor &) const override {}
+        void clear() override {}
+
+        std::size_t bytes() const override
+        {
+            return 0;
+        }
+    };
+
+    void link(heap_object *obj)
+    {
+        obj->owner_ = this;
+        obj->epoch_ = epoch_;
+        obj->prev_ = sentinel_.prev_;
+        obj->next_ = &sentinel_;
+        sentinel_.prev_->next_ = obj;
+        sentinel_.prev_ = obj;
+        ++allocations_;
+    }
+
+    static void unlink(heap_object *obj)
+    {
+        obj->prev_->next_ = obj->next_;
+        obj->next_->prev_ = obj->prev_;
+    }
+
+    sentinel_object sentinel_;
+    std::size_t allocations_;
+    std::size_t threshold_;
+    std::uint32_t epoch_;
+    std::mutex remote_mutex_;
+    std::vector<heap_object *> remote_;
+    std::atomic<bool> has_remote_;
+    gc_stats stats_;
+    std::function<void (gc_stats const &)> hook_;
+};
+
+inline heap_object::heap_object()
+  : refs_(1), gc_refs_(0)
+{
+    heap::current().link(this);
+}
+
+inline void heap_object::add_ref()
+{
+    if (heap::shared())
+        __atomic_add_fetch(&refs_, 1, __ATOMIC_RELAXED);
+    else
+        ++refs_;
+}
+
+inline bool heap_object::is_private() const
+{
+    return owner_ == heap::current_pointer() && epoch_ == owner_->epoch_;
+}
+
+inline void *heap_object::operator new(std::size_t size)
+{
+    if (size <= heap_detail::small_object_pool::max_size)
+        return heap_detail::small_object_pool::local().allocate(size);
+    return ::operator new(size);
+}
+
+inline void heap_object::operator delete(void *ptr, std::size_t size)
+{
+    if (size <= heap_detail::small_object_pool::max_size)
+        heap_detail::small_object_pool::local().deallocate(ptr, size);
+    else
+        ::operator delete(ptr);
+}
+
+inline heap_object::~heap_object()
+{
+    if (prev_)
+        heap::unlink(this);
+}
+
+inline void intrusive_ptr_add_ref(heap_object *obj)
+{
+    obj->add_ref();
+}
+
+inline void intrusive_ptr_release(heap_object *obj)
+{
+    heap::release(obj);
+}
+}
+
+#endif
@@ -0,0 +1,397 @@
+#ifndef IOLISP_IMAGE_HPP
+#define IOLISP_IMAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/range/adaptors.hpp>
+#include "./binary.hpp"
+#include "./errors.hpp"
+#include "./eval.hpp"
+#include "./io_primitives.hpp"
+#include "./primitives.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// An image is a global environment saved to a file, with every frame,
+// function and value reachable from it, so that a program can start from
+// it instead of loading its libraries again.
+//
+// It is one record in the format of binary.hpp, whose payload is a list of:
+//
+//   (iolisp-image 1)
+//   the scopes: (#f . names) for a global scope, or (parent framed . source)
+//     for the scope of a lambda, where framed tells whether any frame has
+//     the scope
+//   the frames: (scope . parent), with #f for no parent
+//   the functions: (scope . closure)
+//   for each frame, its bound slots as (slot . value)
+//
+// where everything is referred to by its position in the list before it,
+// and the global frame comes first. Functions are saved by their source and
+// analysed again on restore, when they are first called unless a frame
+// needs the slots of their scope now; primitives are saved by name.
+namespace image_detail
+{
+static constexpr std::size_t version = 1;
+
+class image_encoder
+  : public binary_detail::encoder
+{
+public:
+    image_encoder()
+    {
+        for (auto const &prim : primitives())
+            primitive_names_[prim.second.call] = prim.first;
+        for (auto const &prim : io_primitives())
+            io_primitive_names_[prim.second.call] = prim.first;
+    }
+
+    std::string const &encode_image(environment const &global)
+    {
+        add_frame(global);
+        while (!pending_.empty())
+        {
+            auto const val = pending_.back();
+            pending_.pop_back();
+            scan(*val);
+        }
+
+        add_element(make_list({value::make<atom>(symbol("iolisp-image")), value::make<number>(version)}));
+
+        std::unordered_set<scope const *> framed;
+        for (auto const &f : frames_)
+            framed.insert(f->layout.get());
+        std::vector<value> entries;
+        for (auto const &sc : scopes_)
+            entries.push_back(sc->parent ?
+                make_pair(
+                    value::make<number>(scope_ids_.at(sc->parent.get())),
+                    make_pair(value::make<bool_>(framed.count(sc.get()) != 0), sc->source)) :
+                make_pair(value::make<bool_>(false), make_list(sc->names | boost::adaptors::transformed(
+                    [](symbol const &name)
+                    {
+                        return value::make<atom>(name);
+                    }))));
+        add_element(make_list(entries));
+
+        entries.clear();
+        for (auto const &f : frames_)
+            entries.push_back(make_pair(
+                value::make<number>(scope_ids_.at(f->layout.get())),
+                f->parent ? value::make<number>(frame_ids_.at(f->parent.get())) : value::make<bool_>(false)));
+        add_element(make_list(entries));
+
+        entries.clear();
+        for (auto const &func : functions_)
+        {
+            auto const &rep = func.get<function>();
+            entries.push_back(make_pair(
+                value::make<number>(scope_ids_.at(rep.body->layout.get())),
+                value::make<number>(frame_ids_.at(rep.closure.get()))));
+        }
+        add_element(make_list(entries));
+
+        for (auto const &f : frames_)
+        {
+            entries.clear();
+            for (std::size_t slot = 0; slot != f->slots.size(); ++slot)
+                if (f->slots[slot])
+                    entries.push_back(make_pair(value::make<number>(slot), *f->slots[slot]));
+            add_element(make_list(entries));
+        }
+        return end_elements();
+    }
+
+private:
+    void emit_extension(value const &val) override
+    {
+        if (val.is<function>())
+        {
+            put(binary_detail::tag::function);
+            put_varint(function_ids_.at(&val.get<function>()));
+        }
+        else if (val.is<primitive_function>() && primitive_names_.count(val.get<primitive_function>().call))
+        {
+            put(binary_detail::tag::primitive);
+            put_bytes(primitive_names_.at(val.get<primitive_function>().call));
+        }
+        else if (val.is<io_function>() && io_primitive_names_.count(val.get<io_function>().call))
+        {
+            put(binary_detail::tag::io_primitive);
+            put_bytes(io_primitive_names_.at(val.get<io_function>().call));
+        }
+        else
+            throw type_mismatch("value that can be saved in an image", val);
+    }
+
+    // Scopes, frames and functions are numbered so that whatever one of
+    // them refers to comes first.
+    void add_scope(std::shared_ptr<scope> const &sc)
+    {
+        if (scope_ids_.count(sc.get()))
+            return;
+        if (sc->parent)
+            add_scope(sc->parent);
+        scope_ids_.emplace(sc.get(), scopes_.size());
+        scopes_.push_back(sc);
+    }
+
+    void add_frame(environment const &f)
+    {
+        if (frame_ids_.count(f.get()))
+            return;
+        if (f->parent)
+            add_frame(f->parent);
+        add_scope(f->layout);
+        frame_ids_.emplace(f.get(), frames_.size());
+        frames_.push_back(f);
+        for (auto const &slot : f->slots)
+            if (slot)
+                pending_.push_back(&*slot);
+    }
+
+    void scan(value const &val)
+    {
+        if (val.is<pair>())
+        {
+            if (val.use_count() > 1 && !scanned_.insert(&val.get<pair>()).second)
+                return;
+            pending_.push_back(&val.get<pair>().car);
+            pending_.push_back(&val.get<pair>().cdr);
+        }
+        else if (val.is<vector>())
+        {
+            if (val.use_count() > 1 && !scanned_.insert(&val.get<vector>()).second)
+                return;
+            for (auto const &elem : val.get<vector>())
+                pending_.push_back(&elem);
+        }
+        else if (val.is<hash_table>())
+        {
+            if (val.use_count() > 1 && !scanned_.insert(&val.get<hash_table>()).second)
+                return;
+            val.get<hash_table>().for_each(
+                [this](value const &key, value const &elem)
+                {
+                    pending_.push_back(&key);
+                    pending_.push_back(&elem);
+                });
+        }
+        else if (val.is<function>() && !function_ids_.count(&val.get<function>()))
+        {
+            auto const &rep = val.get<function>();
+            add_frame(rep.closure);
+            add_scope(rep.body->layout);
+            function_ids_.emplace(&rep, functions_.size());
+            functions_.push_back(val);
+        }
+    }
+
+    std::map<value (*)(arguments), std::string> primitive_names_;
+    std::map<value (*)(arguments), std::string> io_primitive_names_;
+    std::unordered_map<scope const *, std::size_t> scope_ids_;
+    std::vector<std::shared_ptr<scope>> scopes_;
+    std::unordered_map<frame const *, std::size_t> frame_ids_;
+    std::vector<environment> frames_;
+    std::unordered_map<value::function_rep const *, std::size_t> function_ids_;
+    std::vector<value> functions_;
+    std::unordered_set<void const *> scanned_;
+    std::vector<value const *> pending_;
+};
+
+class image_decoder
+  : public binary_detail::decoder
+{
+public:
+    image_decoder(char const *first, char const *last)
+      : decoder(first, last), primitives_(primitives()), io_primitives_(io_primitives())
+    {}
+
+    environment decode_image()
+    {
+        std::size_t element = 0;
+        decode_elements([&](value const &val)
+            {
+                switch (element++)
+                {
+                case 0:
+                    check_header(val);
+                    break;
+                case 1:
+                    for (auto const &entry : list_elements(val))
+                        add_scope(entry);
+                    break;
+                case 2:
+                    for (auto const &entry : list_elements(val))
+                        add_frame(entry);
+                    break;
+                case 3:
+                    for (auto const &entry : list_elements(val))
+                        add_function(entry);
+                    break;
+                default:
+                    if (element - 5 >= frames_.size())
+                        fail("too many frames");
+                    for (auto const &entry : list_elements(val))
+                        define_slot(*frames_[element - 5], entry);
+                }
+            });
+        if (frames_.empty() || element != frames_.size() + 4)
+            fail("missing frames");
+        return frames_.front();
+    }
+
+private:
+    value read_extension(binary_detail::tag t) override
+    {
+        if (t == binary_detail::tag::function)
+        {
+            auto const n = get_varint();
+            if (n >= functions_.size())
+                fail("bad index");
+            return functions_[n];
+        }
+        auto const &table = t == binary_detail::tag::primitive ? primitives_ : io_primitives_;
+        if (t != binary_detail::tag::primitive && t != binary_detail::tag::io_primitive)
+            fail("unknown tag");
+        auto const it = table.find(get_bytes().to_string());
+        if (it == table.end())
+            fail("unknown primitive");
+        return t == binary_detail::tag::primitive ?
+            value::make<primitive_function>(it->second) :
+            value::make<io_function>(it->second);
+    }
+
+    static void check_header(value const &val)
+    {
+        auto const elems = list_elements(val);
+        std::vector<value> const fields(elems.begin(), elems.end());
+        if (fields.size() != 2 || !fields[0].is<atom>() || fields[0].get<atom>() != symbol("iolisp-image") ||
+            !fields[1].is<number>() || fields[1].get<number>() != static_cast<std::int64_t>(version))
+            fail("not an image");
+    }
+
+    static std::size_t index(value const &val, std::size_t size)
+    {
+        if (!val.is<number>() || val.get<number>() < 0 || static_cast<std::size_t>(val.get<number>()) >= size)
+            fail("bad index");
+        return static_cast<std::size_t>(val.get<number>());
+    }
+
+    void add_scope(value const &entry)
+    {
+        if (!entry.is<pair>())
+            fail("bad scope");
+        auto const &fields = entry.get<pair>();
+        if (fields.car.is<bool_>())
+        {
+            auto const sc = std::make_shared<scope>();
+            for (auto const &name : list_elements(fields.cdr))
+            {
+                if (!name.is<atom>())
+                    fail("bad scope");
+                eval_detail::add_slot(*sc, name.get<atom>());
+            }
+            scopes_.push_back(sc);
+            lambdas_.emplace_back();
+            framed_.push_back(true);
+            return;
+        }
+        if (!fields.cdr.is<pair>() || !fields.cdr.get<pair>().car.is<bool_>() || !fields.cdr.get<pair>().cdr.is<pair>())
+            fail("bad scope");
+        auto const framed = fields.cdr.get<pair>().car.get<bool_>();
+        auto const lambda = eval_detail::analyze_lambda(
+            fields.cdr.get<pair>().cdr,
+            scopes_[index(fields.car, scopes_.size())],
+            !framed);
+        scopes_.push_back(lambda->layout);
+        lambdas_.push_back(lambda);
+        framed_.push_back(framed);
+    }
+
+    void add_frame(value const &entry)
+    {
+        if (!entry.is<pair>())
+            fail("bad frame");
+        auto const &fields = entry.get<pair>();
+        auto const n = index(fields.car, scopes_.size());
+        auto const &sc = scopes_[n];
+        auto const parent = fields.cdr.is<bool_>() ? environment() : frames_[index(fields.cdr, frames_.size())];
+        // Variables are found by depth, so the frames must nest as their
+        // scopes do.
+        if (parent ? parent->layout != sc->parent : !!sc->parent)
+            fail("bad frame");
+        // A deferred body could still add slots to its scope.
+        if (!framed_[n])
+            fail("bad frame");
+        frames_.push_back(make_frame(sc, parent));
+    }
+
+    void add_function(value const &entry)
+    {
+        if (!entry.is<pair>())
+            fail("bad function");
+        auto const &fields = entry.get<pair>();
+        auto const &lambda = lambdas_[index(fields.car, lambdas_.size())];
+        auto const &closure = frames_[index(fields.cdr, frames_.size())];
+        if (!lambda || closure->layout != lambda->layout->parent)
+            fail("bad function");
+        functions_.push_back(value::make<function>({
+            lambda->parameters,
+            lambda->variadic_argument,
+            lambda,
+            closure}));
+    }
+
+    static void define_slot(frame &f, value const &entry)
+    {
+        if (!entry.is<pair>())
+            fail("bad slot");
+        auto const &fields = entry.get<pair>();
+        eval_detail::define_variable(f, index(fields.car, f.layout->names.size()), fields.cdr);
+    }
+
+    std::map<std::string, value::primitive_rep> primitives_;
+    std::map<std::string, value::primitive_rep> io_primitives_;
+    std::vector<std::shared_ptr<scope>> scopes_;
+    std::vector<std::shared_ptr<eval_detail::lambda_syntax const>> lambdas_;
+    std::vector<bool> framed_;
+    std::vector<environment> frames_;
+    std::vector<value> functions_;
+};
+}
+
+inline void dump_image(std::string const &filename, environment const &global)
+{
+    std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+    if (!ofs)
+        throw error("Could not open file: " + filename);
+    image_detail::image_encoder enc;
+    binary_detail::write_record(ofs, enc.encode_image(global));
+    ofs.close();
+    if (!ofs)
+        throw error("Could not write file: " + filename);
+}
+
+inline environment restore_image(std::string const &filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+        throw error("Could not open file: " + filename);
+    auto const payload = binary_detail::read_record(ifs);
+    if (!payload)
+        throw corrupt_data("empty image");
+    return image_detail::image_decoder(payload->data(), payload->data() + payload->size()).decode_image();
+}
+}
+
+#endif
@@ -0,0 +1,159 @@
+#define BOOST_RESULT_OF_USE_DECLTYPE
+#define BOOST_SPIRIT_USE_PHOENIX_V3
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/range/adaptors.hpp>
+#include "./eval.hpp"
+#include "./image.hpp"
+#include "./interpreter.hpp"
+#include "./io_primitives.hpp"
+#include "./primitives.hpp"
+#include "./read.hpp"
+
+namespace iolisp
+{
+namespace interpreter_detail
+{
+struct binding
+{
+    symbol name;
+    value::primitive_rep rep;
+    bool io;
+};
+
+// Gathered once, for every interpreter.
+std::vector<binding> const &bindings()
+{
+    static std::vector<binding> const ret = []
+        {
+            std::vector<binding> bs;
+            for (auto const &prim : primitives())
+                bs.push_back({symbol(prim.first), prim.second, false});
+            for (auto const &io_prim : io_primitives())
+                bs.push_back({symbol(io_prim.first), io_prim.second, true});
+            return bs;
+        }();
+    return ret;
+}
+
+environment primitive_bindings()
+{
+    auto const env = make_environment();
+    for (auto const &b : bindings())
+        define_variable(
+            env,
+            b.name,
+            b.io ? value::make<io_function>(b.rep) : value::make<primitive_function>(b.rep));
+    return env;
+}
+}
+
+interpreter::interpreter()
+  : console_(console::standard())
+{
+    scope const s(*this);
+    global_ = interpreter_detail::primitive_bindings();
+    checkpoint();
+}
+
+interpreter::interpreter(std::istream &in, std::ostream &out, buffering policy)
+  : own_console_(new console(in, out, policy)), console_(*own_console_)
+{
+    scope const s(*this);
+    global_ = interpreter_detail::primitive_bindings();
+    checkpoint();
+}
+
+// Functions defined at top level keep the global frame alive through their
+// closures, so dropping it is not enough.
+interpreter::~interpreter()
+{
+    scope const s(*this);
+    console_.end_tasks();
+    saved_.clear();
+    global_.reset();
+    heap_.collect();
+}
+
+value interpreter::eval(std::string const &input)
+{
+    scope const s(*this);
+    return iolisp::eval(global_, read(input));
+}
+
+value interpreter::eval(value const &expr)
+{
+    scope const s(*this);
+    return iolisp::eval(global_, expr);
+}
+
+value interpreter::load(std::string const &filename)
+{
+    scope const s(*this);
+    return iolisp::eval(
+        global_,
+        make_list({value::make<atom>(symbol("load")), value::make<string>(filename)}));
+}
+
+value interpreter::run(std::string const &filename, std::vector<std::string> const &arguments)
+{
+    {
+        scope const s(*this);
+        define_variable(
+            global_,
+            "args",
+            make_list(arguments | boost::adaptors::transformed([](std::string const &arg)
+                {
+                    return value::make<string>(arg);
+                })));
+    }
+    return load(filename);
+}
+
+void interpreter::define(std::string const &name, value const &val)
+{
+    scope const s(*this);
+    define_variable(global_, name, val);
+}
+
+void interpreter::checkpoint()
+{
+    scope const s(*this);
+    saved_ = global_->slots;
+}
+
+// Names defined since the checkpoint keep their slots, unbound, since code
+// analysed meanwhile may refer to them by slot.
+void interpreter::reset()
+{
+    scope const s(*this);
+    console_.end_tasks();
+    heap::exclusive_section const section(heap::is_shared(*global_));
+    auto &slots = global_->slots;
+    std::copy(saved_.begin(), saved_.end(), slots.begin());
+    std::fill(slots.begin() + saved_.size(), slots.end(), boost::none);
+}
+
+void interpreter::restore_image(std::string const &filename)
+{
+    scope const s(*this);
+    global_ = iolisp::restore_image(filename);
+    checkpoint();
+}
+
+void interpreter::dump_image(std::string const &filename)
+{
+    scope const s(*this);
+    iolisp::dump_image(filename, global_);
+}
+
+void interpreter::collect()
+{
+    scope const s(*this);
+    heap_.collect();
+}
+}
@@ -0,0 +1,118 @@
+#ifndef IOLISP_INTERPRETER_HPP
+#define IOLISP_INTERPRETER_HPP
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+#include "./errors.hpp"
+#include "./heap.hpp"
+#include "./port.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// A global environment with a heap and a console of its own, for embedding
+// iolisp. Instances share no mutable state, so each may run on a thread of
+// its own, and one instance serves any number of requests, one thread at a
+// time. Errors are thrown as error.
+//
+// The values an instance returns belong to it: they may be kept, shown and
+// dropped by its caller, but not given to another instance. Futures started
+// by its code write to its console, so when it is reset or destroyed those
+// still running are waited for and the rest are dropped; touching one of
+// those raises an error. Once any instance has started one, values move
+// between threads (see heap::shared), and a collection stops every instance
+// at its next safe point.
+class interpreter
+{
+public:
+    // Starts from the primitives, with standard input and output.
+    interpreter();
+
+    // Starts from the primitives, with in and out as the console.
+    interpreter(std::istream &in, std::ostream &out, buffering policy = buffering::block);
+
+    // Collects the global environment, which flushes and closes the ports
+    // still bound in it.
+    ~interpreter();
+
+    interpreter(interpreter const &) = delete;
+    interpreter &operator=(interpreter const &) = delete;
+
+    // Makes the interpreter current on this thread while it lives, so that
+    // values are allocated from its heap and the I/O primitives use its
+    // console. Every member takes one; callers take one to build values
+    // for it, and hold it no longer, since other threads may be waiting
+    // for this one to reach a safe point.
+    class scope
+    {
+    public:
+        explicit scope(interpreter &interp)
+          : console_(interp.console_), previous_(heap::current_pointer())
+        {
+            heap::current_pointer() = &interp.heap_;
+        }
+
+        scope(scope const &) = delete;
+        scope &operator=(scope const &) = delete;
+
+        ~scope()
+        {
+            heap::current_pointer() = previous_;
+        }
+
+    private:
+        heap::running_section running_;
+        console::scope console_;
+        heap *previous_;
+    };
+
+    // Evaluates the first expression in input, as the REPL does.
+    value eval(std::string const &input);
+
+    value eval(value const &expr);
+
+    // Evaluates every expression in the file, returning the value of the
+    // last.
+    value load(std::string const &filename);
+
+    // Loads the file as iolisp runs a script, with args bound to the
+    // arguments as a list of strings.
+    value run(std::string const &filename, std::vector<std::string> const &arguments);
+
+    void define(std::string const &name, value const &val);
+
+    // Remembers the global variables as they are, for reset to return to.
+    // Taken when the interpreter starts and when an image is restored.
+    void checkpoint();
+
+    // Returns every global variable to its value at the checkpoint, and
+    // unbinds those defined since. This is cheap, so one interpreter can
+    // serve request after request from the same preloaded state. Objects
+    // changed in place, such as a vector held by a global, stay changed.
+    void reset();
+
+    // Replaces the global environment with one saved by dump_image.
+    void restore_image(std::string const &filename);
+
+    void dump_image(std::string const &filename);
+
+    void collect();
+
+    environment const &global() const
+    {
+        return global_;
+    }
+
+private:
+    heap heap_;
+    std::unique_ptr<console> own_console_;
+    console &console_;
+    environment global_;
+    std::vector<boost::optional<value>> saved_;
+};
+}
+
+#endif
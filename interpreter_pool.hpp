@@ -0,0 +1,134 @@
+#ifndef IOLISP_INTERPRETER_POOL_HPP
+#define IOLISP_INTERPRETER_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "./errors.hpp"
+#include "./interpreter.hpp"
+
+namespace iolisp
+{
+// Warm interpreters, one per thread, for running many scripts in one
+// process. Each is prepared once, by restoring an image or loading
+// libraries, and returns to that state after every job (see
+// interpreter::reset), so a job costs no startup and no parsing of what
+// was preloaded. Nothing is shared between them.
+class interpreter_pool
+{
+public:
+    // Called with a free interpreter and its console output, which has no
+    // buffer, so that what is written is dropped, unless the job sets one
+    // for as long as it runs. A job handles its own errors.
+    using job = std::function<void (interpreter &, std::ostream &)>;
+
+    // Returns once every interpreter is prepared. Throws error if one
+    // cannot be.
+    interpreter_pool(std::size_t instances, std::function<void (interpreter &)> const &prepare)
+      : prepare_(prepare), ready_(0), stopping_(false)
+    {
+        for (std::size_t i = 0; i != instances; ++i)
+            threads_.emplace_back([this] { work(); });
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this, instances] { return ready_ == instances || !failure_.empty(); });
+        if (!failure_.empty())
+        {
+            lock.unlock();
+            stop();
+            throw error(failure_);
+        }
+    }
+
+    interpreter_pool(interpreter_pool const &) = delete;
+    interpreter_pool &operator=(interpreter_pool const &) = delete;
+
+    // Waits for the running jobs. Queued ones are dropped.
+    ~interpreter_pool()
+    {
+        stop();
+    }
+
+    std::size_t size() const
+    {
+        return threads_.size();
+    }
+
+    void submit(job j)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(j));
+        }
+        changed_.notify_one();
+    }
+
+private:
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        for (auto &t : threads_)
+            t.join();
+        threads_.clear();
+    }
+
+    void work()
+    {
+        std::istringstream in;
+        std::ostream out(nullptr);
+        interpreter interp(in, out);
+        try
+        {
+            prepare_(interp);
+            interp.checkpoint();
+        }
+        catch (std::exception const &e)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failure_ = e.what();
+            changed_.notify_all();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++ready_;
+        changed_.notify_all();
+        while (true)
+        {
+            changed_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (stopping_)
+                return;
+            auto const next = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+            next(interp, out);
+            out.rdbuf(nullptr);
+            out.clear();
+            interp.reset();
+            lock.lock();
+        }
+    }
+
+    std::function<void (interpreter &)> prepare_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<job> jobs_;
+    std::size_t ready_;
+    std::string failure_;
+    bool stopping_;
+};
+}
+
+#endif
@@ -1,21 +1,36 @@
 #ifndef IOLISP_IO_PRIMITIVES_HPP
 #define IOLISP_IO_PRIMITIVES_HPP
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <ios>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 #include <boost/assert.hpp>
-#include <boost/range/adaptor/sliced.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/range/functions.hpp>
 #include <boost/scope_exit.hpp>
+#include <sys/stat.h>
+#include "./binary.hpp"
 #include "./eval.hpp"
+#include "./future.hpp"
+#include "./load_cache.hpp"
+#include "./port.hpp"
+#include "./primitives.hpp"
 #include "./read.hpp"
 #include "./show.hpp"
+#include "./thread_pool.hpp"
 #include "./value.hpp"
 
 namespace iolisp
@@ -24,20 +39,307 @@ namespace io_primitives_detail
 {
 inline value apply_proc(arguments args)
 {
-    if (boost::size(args) == 2 && (boost::begin(args) + 1)->is<list>())
-        return apply(*boost::begin(args), (boost::begin(args) + 1)->get<list>());
+    if (boost::size(args) == 2 && is_proper_list(*(boost::begin(args) + 1)))
+    {
+        auto const lst = *(boost::begin(args) + 1);
+        auto const elems = list_elements(lst);
+        return apply(*boost::begin(args), std::vector<value>(boost::begin(elems), boost::end(elems)));
+    }
     else if (boost::size(args) >= 1)
-        return apply(*boost::begin(args), args | boost::adaptors::sliced(1, boost::size(args)));
+        return apply(*boost::begin(args), arguments(boost::begin(args) + 1, boost::end(args)));
     throw wrong_number_of_arguments(1, args);
 }
 
-inline value make_port(std::ios::openmode mode, arguments args)
+inline bool is_false(value const &v)
+{
+    return v.is<bool_>() && !v.get<bool_>();
+}
+
+// Calls func with the elements of lists at each position in turn, until the
+// shortest list runs out. call_args is refilled in place for every call, and
+// the results are collected into a list if collect is set.
+template <class Args>
+inline value map_lists(value const &func, arguments lists, Args &call_args, bool collect)
+{
+    std::vector<value const *> pos;
+    for (auto const &lst : lists)
+    {
+        primitives_detail::unpack_list(lst);
+        pos.push_back(&lst);
+    }
+    eval_detail::size_arguments(call_args, pos.size());
+    value head;
+    auto tail = &head;
+    while (std::all_of(pos.begin(), pos.end(), [](value const *p) { return p->is<pair>(); }))
+    {
+        for (std::size_t i = 0; i != pos.size(); ++i)
+        {
+            call_args[i] = pos[i]->get<pair>().car;
+            pos[i] = &pos[i]->get<pair>().cdr;
+        }
+        auto ret = apply(func, call_args);
+        if (collect)
+        {
+            *tail = make_pair(ret, value());
+            tail = &tail->get<pair>().cdr;
+        }
+    }
+    return head;
+}
+
+inline value map_or_for_each(arguments args, bool collect)
+{
+    if (boost::size(args) < 2)
+        throw wrong_number_of_arguments(2, args);
+    auto const lists = arguments(boost::begin(args) + 1, boost::end(args));
+    if (boost::size(lists) == 1)
+    {
+        std::array<value, 1> call_args;
+        return map_lists(args[0], lists, call_args, collect);
+    }
+    std::vector<value> call_args;
+    return map_lists(args[0], lists, call_args, collect);
+}
+
+// (map proc list1 list2 ...)
+inline value map_proc(arguments args)
+{
+    return map_or_for_each(args, true);
+}
+
+// (for-each proc list1 list2 ...)
+inline value for_each_proc(arguments args)
+{
+    map_or_for_each(args, false);
+    return value::make<bool_>(true);
+}
+
+// (filter pred list) keeps the elements for which pred is not #f, in order.
+inline value filter_proc(value const &pred, value const &lst)
+{
+    primitives_detail::unpack_list(lst);
+    std::array<value, 1> call_args;
+    value head;
+    auto tail = &head;
+    for (auto const &elem : list_elements(lst))
+    {
+        call_args[0] = elem;
+        if (is_false(apply(pred, call_args)))
+            continue;
+        *tail = make_pair(elem, value());
+        tail = &tail->get<pair>().cdr;
+    }
+    return head;
+}
+
+// (hash-table-walk table proc) calls proc with each key and value. The
+// entries are gathered first, so proc may change the table.
+inline value hash_table_walk(value const &table, value const &proc)
+{
+    std::vector<std::pair<value, value>> entries;
+    entries.reserve(primitives_detail::unpack_hash_table(table).size());
+    primitives_detail::unpack_hash_table(table).for_each(
+        [&](value const &key, value const &val)
+        {
+            entries.emplace_back(key, val);
+        });
+    std::array<value, 2> call_args;
+    for (auto &entry : entries)
+    {
+        call_args[0] = std::move(entry.first);
+        call_args[1] = std::move(entry.second);
+        apply(proc, call_args);
+    }
+    return value::make<bool_>(true);
+}
+
+// (fold-left proc init list) is (proc (proc init e1) e2) and so on.
+inline value fold_left_proc(arguments args)
+{
+    primitives_detail::unpack_list(args[2]);
+    std::array<value, 2> call_args;
+    auto acc = args[1];
+    for (auto const &elem : list_elements(args[2]))
+    {
+        call_args[0] = std::move(acc);
+        call_args[1] = elem;
+        acc = apply(args[0], call_args);
+    }
+    return acc;
+}
+
+// (fold-right proc init list) is (proc e1 (proc e2 ... (proc en init))).
+inline value fold_right_proc(arguments args)
+{
+    primitives_detail::unpack_list(args[2]);
+    auto const elems = list_elements(args[2]);
+    std::vector<value> const vec(boost::begin(elems), boost::end(elems));
+    std::array<value, 2> call_args;
+    auto acc = args[1];
+    for (auto it = vec.rbegin(); it != vec.rend(); ++it)
+    {
+        call_args[0] = *it;
+        call_args[1] = std::move(acc);
+        acc = apply(args[0], call_args);
+    }
+    return acc;
+}
+
+// (sort list less?) returns a sorted copy of list. Elements that neither
+// precedes the other keep their order.
+inline value sort_proc(value const &lst, value const &less)
+{
+    primitives_detail::unpack_list(lst);
+    auto const elems = list_elements(lst);
+    std::vector<value> vec(boost::begin(elems), boost::end(elems));
+    std::array<value, 2> call_args;
+    std::stable_sort(vec.begin(), vec.end(), [&](value const &lhs, value const &rhs)
+        {
+            call_args[0] = lhs;
+            call_args[1] = rhs;
+            return !is_false(apply(less, call_args));
+        });
+    return make_list(vec);
+}
+
+// (future thunk) starts calling thunk on the thread pool.
+inline value future_proc(value const &thunk)
+{
+    return make_future([thunk] { return apply(thunk, arguments()); });
+}
+
+// (touch future) waits for the value of the future. Anything else is its
+// own value.
+inline value touch_proc(value const &val)
+{
+    if (val.is<future>())
+        return val.get<future>()->touch();
+    return val;
+}
+
+// Calls proc with arity arguments at a time from calls, keeping the results
+// in order.
+class map_chunk
+  : public task
+{
+public:
+    map_chunk(value const &proc, std::size_t arity, std::vector<value> calls)
+      : proc_(proc), arity_(arity), calls_(std::move(calls))
+    {}
+
+    std::vector<value> results;
+    std::exception_ptr error;
+
+protected:
+    void execute() override
+    {
+        try
+        {
+            for (auto pos = calls_.data(); pos != calls_.data() + calls_.size(); pos += arity_)
+                results.push_back(apply(proc_, arguments(pos, pos + arity_)));
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        calls_.clear();
+    }
+
+    void drop() override
+    {
+        error = std::make_exception_ptr(iolisp::error("parallel-map dropped when its job ended"));
+        calls_.clear();
+    }
+
+private:
+    value proc_;
+    std::size_t arity_;
+    std::vector<value> calls_;
+};
+
+// (parallel-map proc list1 list2 ...) is map with the calls spread over the
+// thread pool, so they are made in no particular order. The first error in
+// list order is raised once the calls before it are done.
+inline value parallel_map_proc(arguments args)
+{
+    if (boost::size(args) < 2)
+        throw wrong_number_of_arguments(2, args);
+    std::vector<value const *> pos;
+    for (auto const &lst : arguments(boost::begin(args) + 1, boost::end(args)))
+    {
+        primitives_detail::unpack_list(lst);
+        pos.push_back(&lst);
+    }
+    std::vector<value> calls;
+    while (std::all_of(pos.begin(), pos.end(), [](value const *p) { return p->is<pair>(); }))
+        for (auto &p : pos)
+        {
+            calls.push_back(p->get<pair>().car);
+            p = &p->get<pair>().cdr;
+        }
+    auto &pool = thread_pool::get();
+    auto const count = calls.size() / pos.size();
+    // A few chunks per thread, so that threads finishing early steal from
+    // the rest.
+    auto const chunks = std::min(count, pool.size() * 4);
+    std::vector<std::shared_ptr<map_chunk>> tasks;
+    for (std::size_t i = 0; i != chunks; ++i)
+    {
+        auto const first = calls.begin() + count * i / chunks * pos.size();
+        auto const last = calls.begin() + count * (i + 1) / chunks * pos.size();
+        tasks.push_back(std::make_shared<map_chunk>(
+            args[0],
+            pos.size(),
+            std::vector<value>(std::make_move_iterator(first), std::make_move_iterator(last))));
+        pool.submit(tasks.back());
+    }
+    std::vector<value> results;
+    results.reserve(count);
+    for (auto const &t : tasks)
+    {
+        pool.wait(*t);
+        if (t->error)
+            std::rethrow_exception(t->error);
+        std::move(t->results.begin(), t->results.end(), std::back_inserter(results));
+    }
+    return make_list(results);
+}
+
+inline buffering unpack_buffering(value const &v)
 {
-    if (boost::size(args) == 1 && boost::begin(args)->is<string>())
+    if (v.is<atom>())
     {
-        return value::make<port>(
-            std::make_shared<std::fstream>(boost::begin(args)->get<string>(), mode));
+        auto const &name = v.get<atom>().name();
+        if (name == "none")
+            return buffering::none;
+        else if (name == "line")
+            return buffering::line;
+        else if (name == "block")
+            return buffering::block;
     }
+    throw type_mismatch("buffering (none, line or block)", v);
+}
+
+inline value make_port(std::ios::openmode mode, value const &filename, buffering policy)
+{
+    if (filename.is<string>())
+        return value::make<port>(std::make_shared<file_port>(filename.get<string>(), mode, policy));
+    throw wrong_number_of_arguments(1, std::array<value, 1>{{filename}});
+}
+
+inline value open_input_file(value const &filename)
+{
+    return make_port(std::fstream::in, filename, buffering::block);
+}
+
+// (open-output-file filename [buffering]) where buffering is one of the
+// symbols none, line or block. Files are block buffered by default.
+inline value open_output_file(arguments args)
+{
+    if (boost::size(args) == 1)
+        return make_port(std::fstream::out, args[0], buffering::block);
+    else if (boost::size(args) == 2)
+        return make_port(std::fstream::out, args[0], unpack_buffering(args[1]));
     throw wrong_number_of_arguments(1, args);
 }
 
@@ -45,7 +347,9 @@ inline value close_port(arguments args)
 {
     if (boost::size(args) == 1 && boost::begin(args)->is<port>())
     {
-        boost::begin(args)->get<port>()->close();
+        auto &p = *boost::begin(args)->get<port>();
+        std::lock_guard<std::mutex> const lock(p.mutex());
+        p.close();
         return value::make<bool_>(true);
     }
     return value::make<bool_>(false);
@@ -56,79 +360,234 @@ inline value read_proc(arguments args)
     if (boost::empty(args))
     {
         std::string ret;
-        std::getline(std::cin, ret);
+        {
+            heap::blocking_section const blocking;
+            std::getline(console::current().in(), ret);
+        }
         return value::make<string>(ret);
     }
     else if (boost::size(args) == 1 && boost::begin(args)->is<port>())
     {
+        auto &p = *boost::begin(args)->get<port>();
         std::string ret;
-        std::getline(*boost::begin(args)->get<port>(), ret);
+        {
+            std::lock_guard<std::mutex> const lock(p.mutex());
+            std::getline(p, ret);
+        }
         return value::make<string>(ret);
     }
     throw wrong_number_of_arguments(0, args);
 }
 
-inline value write_proc(arguments args)
+// Where an output primitive writes: the port given after its count other
+// arguments, or the console, locked until the write is done.
+struct output_target
 {
-    if (boost::size(args) == 1)
+    std::ostream &stream;
+    buffering policy;
+    std::unique_lock<std::mutex> lock;
+};
+
+inline output_target output_port(arguments args, std::size_t count)
+{
+    if (boost::size(args) == count)
     {
-        std::cout << *boost::begin(args) << std::endl;
-        return value::make<bool_>(true);
+        auto &c = console::current();
+        return {c.out(), c.policy(), std::unique_lock<std::mutex>(c.mutex())};
     }
-    else if (boost::size(args) == 2 && (boost::begin(args) + 1)->is<port>())
+    else if (boost::size(args) == count + 1 && args[count].is<port>())
     {
-        *(boost::begin(args) + 1)->get<port>() << *boost::begin(args) << std::endl;
-        return value::make<bool_>(true);
+        auto &p = *args[count].get<port>();
+        return {p, p.policy(), std::unique_lock<std::mutex>(p.mutex())};
+    }
+    throw wrong_number_of_arguments(count, args);
+}
+
+// Writes the value followed by a newline.
+inline value write_proc(arguments args)
+{
+    auto const out = output_port(args, 1);
+    out.stream << args[0] << '\n';
+    written(out.stream, out.policy, true);
+    return value::make<bool_>(true);
+}
+
+inline value write_simple(arguments args)
+{
+    auto const out = output_port(args, 1);
+    out.stream << args[0];
+    written(out.stream, out.policy, false);
+    return value::make<bool_>(true);
+}
+
+// Like write-simple, but strings are written without quotes.
+inline value display(arguments args)
+{
+    auto const out = output_port(args, 1);
+    if (is_text(args[0]))
+        out.stream << text_of(args[0]);
+    else
+        out.stream << args[0];
+    written(out.stream, out.policy, false);
+    return value::make<bool_>(true);
+}
+
+inline value newline(arguments args)
+{
+    auto const out = output_port(args, 0);
+    out.stream << '\n';
+    written(out.stream, out.policy, true);
+    return value::make<bool_>(true);
+}
+
+inline value flush_output_port(arguments args)
+{
+    output_port(args, 0).stream.flush();
+    return value::make<bool_>(true);
+}
+
+// Writes one record in the format described in binary.hpp.
+inline value write_binary_proc(arguments args)
+{
+    auto const out = output_port(args, 1);
+    write_binary(out.stream, args[0]);
+    written(out.stream, out.policy, false);
+    return value::make<bool_>(true);
+}
+
+// Reads the next record written by write-binary, or returns #f once the port
+// is exhausted.
+inline value read_binary_proc(arguments args)
+{
+    if (boost::empty(args))
+        return read_binary(console::current().in()).value_or(value::make<bool_>(false));
+    else if (boost::size(args) == 1 && boost::begin(args)->is<port>())
+    {
+        auto &p = *boost::begin(args)->get<port>();
+        std::lock_guard<std::mutex> const lock(p.mutex());
+        return read_binary(p).value_or(value::make<bool_>(false));
     }
     throw wrong_number_of_arguments(0, args);
 }
 
 inline std::string read_file(std::string const &filename)
 {
-    std::ifstream ifs(filename);
-    ifs.seekg(0, std::ifstream::end);
-    auto const len = ifs.tellg();
-    ifs.seekg(0, std::ifstream::beg);
-    std::string buf(len, '\0');
-    if (len != 0)
-        ifs.read(&buf.front(), len);
-    return buf;
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+        throw error("Could not open file: " + filename);
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+    return oss.str();
 }
 
-inline value read_contents(arguments args)
+// Maps the file and returns a slice of the mapping, which stays mapped for
+// as long as any slice of it is alive. Files that cannot be mapped, such as
+// empty files and pipes, are read into a string instead.
+inline value map_file(std::string const &filename)
 {
-    if (boost::size(args) == 1 && boost::begin(args)->is<string>())
-        return value::make<string>(read_file(boost::begin(args)->get<string>()));
-    throw wrong_number_of_arguments(1, args);
+    namespace ipc = boost::interprocess;
+    try
+    {
+        ipc::file_mapping const file(filename.c_str(), ipc::read_only);
+        auto const region = std::make_shared<ipc::mapped_region>(file, ipc::read_only);
+        region->advise(ipc::mapped_region::advice_sequential);
+        auto const text = boost::string_view(
+            static_cast<char const *>(region->get_address()),
+            region->get_size());
+        return value::make<string_slice>(value::slice_rep{region, text});
+    }
+    catch (ipc::interprocess_exception const &)
+    {
+        return value::make<string>(read_file(filename));
+    }
 }
 
-inline value read_all(arguments args)
+inline value read_contents(value const &filename)
 {
-    if (boost::size(args) == 1 && boost::begin(args)->is<string>())
-        return value::make<list>(load(boost::begin(args)->get<string>()));
-    throw wrong_number_of_arguments(1, args);
+    if (filename.is<string>())
+        return map_file(filename.get<string>());
+    throw wrong_number_of_arguments(1, std::array<value, 1>{{filename}});
+}
+
+// Calls fn with each form of the file as it is read.
+inline void read_forms(std::string const &filename, std::function<void (value const &)> const &fn)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+        throw error("Could not open file: " + filename);
+    reader rdr(ifs);
+    while (auto const val = rdr.next())
+        fn(*val);
+}
+
+inline value read_all(value const &filename)
+{
+    if (filename.is<string>())
+    {
+        value head;
+        auto tail = &head;
+        read_forms(filename.get<string>(), [&](value const &val)
+            {
+                *tail = make_pair(val, value());
+                tail = &tail->get<pair>().cdr;
+            });
+        return head;
+    }
+    throw wrong_number_of_arguments(1, std::array<value, 1>{{filename}});
 }
 }
 
-inline std::vector<value> load(std::string const &filename)
+// Like read_forms, but goes through the load cache, if it is on, for regular
+// files. The cache is only written once every form has been evaluated.
+inline void load(std::string const &filename, std::function<void (value const &)> const &fn)
 {
-    return read_expr_list(io_primitives_detail::read_file(filename));
+    using namespace io_primitives_detail;
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return read_forms(filename, fn);
+    auto const loc = load_cache_detail::locate(filename);
+    if (!loc)
+        return read_forms(filename, fn);
+    if (load_cached(*loc, st, fn))
+        return;
+    load_cache_writer cache(*loc, st, load_cache_detail::content_hash(loc->source));
+    read_forms(filename, [&](value const &form)
+        {
+            cache.add(form);
+            fn(form);
+        });
+    cache.commit();
 }
 
-inline std::map<std::string, std::function<value (arguments)>> io_primitives()
+inline std::map<std::string, value::primitive_rep> io_primitives()
 {
     using namespace io_primitives_detail;
-    using namespace std::placeholders;
     return {
-        {"apply", &apply_proc},
-        {"open-input-file", std::bind(&make_port, std::fstream::in, _1)},
-        {"open-output-file", std::bind(&make_port, std::fstream::out, _1)},
-        {"close-input-port", &close_port},
-        {"close-output-port", &close_port},
-        {"read", &read_proc},
-        {"write", &write_proc},
-        {"read-contents", &read_contents},
-        {"read-all", &read_all}};
+        {"apply", make_primitive(&apply_proc)},
+        {"map", make_primitive(&map_proc)},
+        {"for-each", make_primitive(&for_each_proc)},
+        {"filter", make_binary_primitive<&filter_proc>()},
+        {"fold-left", make_primitive(&fold_left_proc, 3)},
+        {"fold-right", make_primitive(&fold_right_proc, 3)},
+        {"sort", make_binary_primitive<&sort_proc>()},
+        {"hash-table-walk", make_binary_primitive<&hash_table_walk>()},
+        {"future", make_unary_primitive<&future_proc>()},
+        {"touch", make_unary_primitive<&touch_proc>()},
+        {"parallel-map", make_primitive(&parallel_map_proc)},
+        {"open-input-file", make_unary_primitive<&open_input_file>()},
+        {"open-output-file", make_primitive(&open_output_file)},
+        {"close-input-port", make_primitive(&close_port)},
+        {"close-output-port", make_primitive(&close_port)},
+        {"read", make_primitive(&read_proc)},
+        {"write", make_primitive(&write_proc)},
+        {"write-simple", make_primitive(&write_simple)},
+        {"display", make_primitive(&display)},
+        {"newline", make_primitive(&newline)},
+        {"flush-output-port", make_primitive(&flush_output_port)},
+        {"write-binary", make_primitive(&write_binary_proc)},
+        {"read-binary", make_primitive(&read_binary_proc)},
+        {"read-contents", make_unary_primitive<&read_contents>()},
+        {"read-all", make_unary_primitive<&read_all>()}};
 }
 }
 
@@ -0,0 +1,182 @@
+#ifndef IOLISP_LOAD_CACHE_HPP
+#define IOLISP_LOAD_CACHE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./binary.hpp"
+#include "./errors.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+// When $IOLISP_CACHE_DIR is set, files that have been loaded once keep
+// their forms in a cache file there, in the format of binary.hpp, so later
+// loads skip the reader. Nothing is cached otherwise.
+//
+// A source is known by its canonical path, which names its cache file. The
+// first record is the key (path mtime ctime size hash) and every form
+// follows as a record of its own. A cache for another path is never used.
+// One whose mtime, ctime and size match is used as is; otherwise the source
+// is hashed, and the cache is still used if the contents are unchanged.
+// Writing a file always sets its ctime, which, unlike the mtime, cannot be
+// set back.
+namespace load_cache_detail
+{
+// FNV-1a, which is stable from run to run.
+inline std::int64_t content_hash(std::string const &filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    std::uint64_t hash = 14695981039346656037ull;
+    char chunk[64 * 1024];
+    while (ifs.read(chunk, sizeof(chunk)) || ifs.gcount() > 0)
+        for (auto pos = chunk; pos != chunk + ifs.gcount(); ++pos)
+            hash = (hash ^ static_cast<unsigned char>(*pos)) * 1099511628211ull;
+    return static_cast<std::int64_t>(hash);
+}
+
+// The canonical path of a source and the cache file for it.
+struct location
+{
+    std::string source;
+    std::string cache;
+};
+
+// None if caching is off or the source has no canonical path.
+inline boost::optional<location> locate(std::string const &filename)
+{
+    auto const dir = std::getenv("IOLISP_CACHE_DIR");
+    if (!dir || !*dir)
+        return boost::none;
+    std::unique_ptr<char, void (*)(void *)> const resolved(::realpath(filename.c_str(), nullptr), &std::free);
+    if (!resolved)
+        return boost::none;
+    location ret{resolved.get(), dir};
+    std::uint64_t hash = 14695981039346656037ull;
+    for (auto const c : ret.source)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.iolc", static_cast<unsigned long long>(hash));
+    ret.cache += name;
+    return ret;
+}
+
+inline std::int64_t nanoseconds(struct timespec const &t)
+{
+    return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+inline value make_key(std::string const &source, struct stat const &st, std::int64_t hash)
+{
+    return make_list({
+        value::make<string>(source),
+        value::make<number>(nanoseconds(st.st_mtim)),
+        value::make<number>(nanoseconds(st.st_ctim)),
+        value::make<number>(st.st_size),
+        value::make<number>(hash)});
+}
+
+inline bool key_matches(value const &key, std::string const &source, struct stat const &st)
+{
+    auto const elements = list_elements(key);
+    std::vector<value> const fields(elements.begin(), elements.end());
+    if (fields.size() != 5 || !fields[0].is<string>() || fields[0].get<string>() != source ||
+        !std::all_of(fields.begin() + 1, fields.end(), [](value const &v) { return v.is<number>(); }))
+        return false;
+    if (fields[1].get<number>() == nanoseconds(st.st_mtim) &&
+        fields[2].get<number>() == nanoseconds(st.st_ctim) &&
+        fields[3].get<number>() == st.st_size)
+        return true;
+    return fields[4].get<number>() == content_hash(source);
+}
+}
+
+// Calls fn with each cached form of the source and returns true, or returns
+// false if there is no current cache. Every form is decoded before fn sees
+// the first, so a damaged cache runs none of them and the source is read
+// instead.
+template <class Fn>
+inline bool load_cached(load_cache_detail::location const &loc, struct stat const &st, Fn const &fn)
+{
+    using namespace load_cache_detail;
+    std::ifstream ifs(loc.cache, std::ios::binary);
+    if (!ifs)
+        return false;
+    std::vector<value> forms;
+    try
+    {
+        auto const key = read_binary(ifs);
+        if (!key || !is_proper_list(*key) || !key_matches(*key, loc.source, st))
+            return false;
+        auto const payload = binary_detail::read_record(ifs);
+        if (!payload)
+            return false;
+        binary_detail::decoder(payload->data(), payload->data() + payload->size()).decode_elements(
+            [&](value const &form) { forms.push_back(form); });
+    }
+    catch (corrupt_data const &)
+    {
+        return false;
+    }
+    for (auto const &form : forms)
+        fn(form);
+    return true;
+}
+
+// Encodes the forms of a source as it is read, and replaces the cache with
+// them on commit(). The source's contents must have hashed to hash. The new
+// cache is written to a temporary file of its own, even for another thread
+// loading the same source, and renamed into place, so readers never see a
+// partial one; a load that fails before commit() leaves the old cache
+// alone.
+class load_cache_writer
+{
+public:
+    load_cache_writer(load_cache_detail::location const &loc, struct stat const &st, std::int64_t hash)
+      : key_(load_cache_detail::make_key(loc.source, st, hash)),
+        path_(loc.cache)
+    {}
+
+    void add(value const &form)
+    {
+        forms_.add_element(form);
+    }
+
+    // Failures leave nothing cached.
+    void commit()
+    {
+        std::string temp = path_ + ".XXXXXX";
+        auto const fd = ::mkstemp(&temp[0]);
+        if (fd < 0)
+            return;
+        ::close(fd);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            std::remove(temp.c_str());
+            return;
+        }
+        write_binary(out, key_);
+        binary_detail::write_record(out, forms_.end_elements());
+        out.close();
+        if (!out || std::rename(temp.c_str(), path_.c_str()) != 0)
+            std::remove(temp.c_str());
+    }
+
+private:
+    value key_;
+    std::string path_;
+    binary_detail::encoder forms_;
+};
+}
+
+#endif
@@ -1,48 +1,32 @@
 #define BOOST_RESULT_OF_USE_DECLTYPE
 #define BOOST_SPIRIT_USE_PHOENIX_V3
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
-#include <map>
-#include <memory>
 #include <string>
-#include <boost/range/adaptors.hpp>
-#include <boost/range/functions.hpp>
-#include <boost/range/iterator_range.hpp>
-#include "./eval.hpp"
-#include "./io_primitives.hpp"
-#include "./primitives.hpp"
-#include "./read.hpp"
+#include <thread>
+#include <vector>
+#include "./batch.hpp"
+#include "./interpreter.hpp"
+#include "./interpreter_pool.hpp"
+#include "./server.hpp"
 #include "./show.hpp"
 
 using namespace iolisp;
 
-environment primitive_bindings()
-{
-    auto const env = std::make_shared<std::map<std::string, std::shared_ptr<value>>>();
-    for (auto const &prim : primitives())
-        env->insert({
-            prim.first,
-            std::make_shared<value>(value::make<primitive_function>(prim.second))});
-    for (auto const &io_prim : io_primitives())
-        env->insert({
-            io_prim.first,
-            std::make_shared<value>(value::make<io_function>(io_prim.second))});
-    return env;
-}
-
-void eval_and_print(environment const &env, std::string const &input)
+void eval_and_print(interpreter &interp, std::string const &input)
 try
 {
-    std::cout << eval(env, read(input)) << std::endl;
+    std::cout << interp.eval(input) << std::endl;
 }
 catch (error const &e)
 {
     std::cerr << e.what() << std::endl;
 }
 
-void run_repl()
+void run_repl(interpreter &interp)
 {
-    auto const env = primitive_bindings();
     while (true)
     {
         std::cout << "iolisp>>> ";
@@ -51,27 +35,90 @@ void run_repl()
         if (input == "quit")
             break;
         else
-            eval_and_print(env, input);
+            eval_and_print(interp, input);
     }
 }
 
-void run_one(boost::iterator_range<char **> rng)
+int run_one(interpreter &interp, char **first, char **last)
+try
+{
+    std::cout << interp.run(*first, {first + 1, last}) << std::endl;
+    return 0;
+}
+catch (error const &e)
 {
-    auto const env = primitive_bindings();
-    auto const args = rng
-        | boost::adaptors::sliced(1, boost::size(rng))
-        | boost::adaptors::transformed(&value::make<string>);
-    define_variable(env, "args", value::make<list>({boost::begin(args), boost::end(args)}));
-    auto const val = value::make<list>({
-        value::make<atom>("load"),
-        value::make<string>(*rng.begin())});
-    std::cout << eval(env, val) << std::endl;
+    std::cerr << e.what() << std::endl;
+    return 1;
 }
 
+// iolisp [--image FILE] [--preload FILE]... [--dump-image FILE] [script args...]
+// iolisp [--image FILE] [--preload FILE]... [--instances N] --serve SOCKET
+// iolisp [--image FILE] [--preload FILE]... [--instances N] --batch script...
+//
+// --image starts from a saved environment instead of the primitives alone.
+// --preload loads a file before the script or REPL.
+// --dump-image saves the environment once the script or REPL has finished.
+// --serve runs the scripts sent by iolisp-client on N interpreters, one per
+// core by default, each prepared by --image and --preload once.
+// --batch runs the scripts concurrently on such interpreters, writing what
+// each writes under a header with its exit status (see run_batch).
 int main(int argc, char *argv[])
+try
 {
-    if (argc == 1)
-        run_repl();
+    auto first = argv + 1;
+    auto const last = argv + argc;
+    std::string image, dump, socket;
+    std::vector<std::string> preload;
+    auto instances = 0;
+    for (; last - first >= 2; first += 2)
+        if (first[0] == std::string("--image"))
+            image = first[1];
+        else if (first[0] == std::string("--preload"))
+            preload.push_back(first[1]);
+        else if (first[0] == std::string("--dump-image"))
+            dump = first[1];
+        else if (first[0] == std::string("--serve"))
+            socket = first[1];
+        else if (first[0] == std::string("--instances"))
+            instances = std::atoi(first[1]);
+        else
+            break;
+    auto const prepare = [&](interpreter &interp)
+        {
+            if (!image.empty())
+                interp.restore_image(image);
+            for (auto const &file : preload)
+                interp.load(file);
+        };
+    auto const batch = first != last && first[0] == std::string("--batch");
+    if (instances <= 0)
+        instances = std::max(std::thread::hardware_concurrency(), 1u);
+    if (!socket.empty())
+    {
+        if (first != last)
+            throw error("--serve takes no script");
+        interpreter_pool pool(instances, prepare);
+        server(socket, pool).run();
+    }
+    else if (batch)
+    {
+        std::vector<std::string> const scripts(first + 1, last);
+        interpreter_pool pool(std::min<std::size_t>(instances, std::max<std::size_t>(scripts.size(), 1)), prepare);
+        return run_batch(pool, scripts, std::cout, std::cerr);
+    }
+    interpreter interp;
+    prepare(interp);
+    auto status = 0;
+    if (first == last)
+        run_repl(interp);
     else
-        run_one(boost::make_iterator_range(argv + 1, argv + argc));
+        status = run_one(interp, first, last);
+    if (!dump.empty() && status == 0)
+        interp.dump_image(dump);
+    return status;
+}
+catch (error const &e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
 }
@@ -0,0 +1,301 @@
+#ifndef IOLISP_NUMBER_HPP
+#define IOLISP_NUMBER_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include "./errors.hpp"
+#include "./value.hpp"
+
+namespace iolisp
+{
+using bigint = value::rep<bignum>;
+
+// Integers that fit in a fixnum are always stored as one, so a bignum is
+// never equal to a fixnum.
+inline value make_integer(bigint const &n)
+{
+    if (n >= std::numeric_limits<std::int64_t>::min() &&
+        n <= std::numeric_limits<std::int64_t>::max())
+        return value::make<number>(n.convert_to<std::int64_t>());
+    return value::make<bignum>(n);
+}
+
+inline bool is_integer(value const &val)
+{
+    return val.is<number>() || val.is<bignum>();
+}
+
+// Integers and flonums. Arithmetic on a flonum gives a flonum.
+inline bool is_number(value const &val)
+{
+    return is_integer(val) || val.is<flonum>();
+}
+
+inline double to_double(value const &val)
+{
+    BOOST_ASSERT(is_number(val));
+    if (val.is<flonum>())
+        return val.get<flonum>();
+    return val.is<number>() ? static_cast<double>(val.get<number>()) : val.get<bignum>().convert_to<double>();
+}
+
+inline bool is_nan(value const &val)
+{
+    return val.is<flonum>() && std::isnan(val.get<flonum>());
+}
+
+inline bigint to_bigint(value const &val)
+{
+    BOOST_ASSERT(is_integer(val));
+    return val.is<number>() ? bigint(val.get<number>()) : val.get<bignum>();
+}
+
+// Parses an optionally signed run of decimal digits of any length.
+inline boost::optional<value> parse_integer(boost::string_view text)
+{
+    auto const digits = !text.empty() && (text[0] == '-' || text[0] == '+')
+        ? text.substr(1)
+        : text;
+    if (digits.empty())
+        return boost::none;
+    for (auto const c : digits)
+        if (c < '0' || c > '9')
+            return boost::none;
+    // Anything shorter than this fits in a fixnum.
+    if (digits.size() < std::numeric_limits<std::int64_t>::digits10)
+    {
+        std::int64_t n = 0;
+        for (auto const c : digits)
+            n = n * 10 + (c - '0');
+        return value::make<number>(text[0] == '-' ? -n : n);
+    }
+    auto const n = bigint(std::string(digits.begin(), digits.end()));
+    return make_integer(text[0] == '-' ? bigint(-n) : n);
+}
+
+// Parses an integer, or a decimal with a fraction, an exponent or both,
+// which is a flonum, or one of +inf.0, -inf.0, +nan.0 and -nan.0. Any of
+// them may be signed.
+inline boost::optional<value> parse_number(boost::string_view text)
+{
+    if (text.size() == 6 && (text[0] == '+' || text[0] == '-') &&
+        (text.substr(1) == "inf.0" || text.substr(1) == "nan.0"))
+    {
+        auto const magnitude = text[1] == 'i'
+            ? std::numeric_limits<double>::infinity()
+            : std::numeric_limits<double>::quiet_NaN();
+        return value::make<flonum>(text[0] == '-' ? -magnitude : magnitude);
+    }
+    else if (text.find_first_of(".eE") == boost::string_view::npos)
+        return parse_integer(text);
+    auto const str = text.to_string();
+    char *end;
+    auto const d = std::strtod(str.c_str(), &end);
+    if (end != str.c_str() + str.size())
+        return boost::none;
+    return value::make<flonum>(d);
+}
+
+inline std::string integer_to_string(value const &val)
+{
+    BOOST_ASSERT(is_integer(val));
+    return val.is<number>() ? std::to_string(val.get<number>()) : val.get<bignum>().str();
+}
+
+namespace number_detail
+{
+// Each operation has a fixnum path, which reports overflow by returning
+// false, and a bignum path that is always correct.
+struct add
+{
+    static bool fixnum(std::int64_t lhs, std::int64_t rhs, std::int64_t &ret)
+    {
+        return !__builtin_add_overflow(lhs, rhs, &ret);
+    }
+
+    static bigint bignum(bigint const &lhs, bigint const &rhs)
+    {
+        return lhs + rhs;
+    }
+
+    static double flonum(double lhs, double rhs)
+    {
+        return lhs + rhs;
+    }
+};
+
+struct subtract
+{
+    static bool fixnum(std::int64_t lhs, std::int64_t rhs, std::int64_t &ret)
+    {
+        return !__builtin_sub_overflow(lhs, rhs, &ret);
+    }
+
+    static bigint bignum(bigint const &lhs, bigint const &rhs)
+    {
+        return lhs - rhs;
+    }
+
+    static double flonum(double lhs, double rhs)
+    {
+        return lhs - rhs;
+    }
+};
+
+struct multiply
+{
+    static bool fixnum(std::int64_t lhs, std::int64_t rhs, std::int64_t &ret)
+    {
+        return !__builtin_mul_overflow(lhs, rhs, &ret);
+    }
+
+    static bigint bignum(bigint const &lhs, bigint const &rhs)
+    {
+        return lhs * rhs;
+    }
+
+    static double flonum(double lhs, double rhs)
+    {
+        return lhs * rhs;
+    }
+};
+
+// Division of integers truncates towards zero, as C++ does. A zero divisor
+// and the one overflowing quotient are left to the bignum path. Flonums
+// divide exactly, and by zero give an infinity or NaN.
+struct divide
+{
+    static bool fixnum(std::int64_t lhs, std::int64_t rhs, std::int64_t &ret)
+    {
+        if (rhs == 0 || (rhs == -1 && lhs == std::numeric_limits<std::int64_t>::min()))
+            return false;
+        ret = lhs / rhs;
+        return true;
+    }
+
+    static bigint bignum(bigint const &lhs, bigint const &rhs)
+    {
+        if (rhs == 0)
+            throw division_by_zero();
+        return lhs / rhs;
+    }
+
+    static double flonum(double lhs, double rhs)
+    {
+        return lhs / rhs;
+    }
+};
+
+// Like divide, but the quotient of flonums is truncated towards zero too.
+struct quotient
+  : divide
+{
+    static double flonum(double lhs, double rhs)
+    {
+        return std::trunc(lhs / rhs);
+    }
+};
+
+// The remainder takes the sign of the dividend.
+struct remainder
+{
+    static bool fixnum(std::int64_t lhs, std::int64_t rhs, std::int64_t &ret)
+    {
+        if (rhs == 0 || (rhs == -1 && lhs == std::numeric_limits<std::int64_t>::min()))
+            return false;
+        ret = lhs % rhs;
+        return true;
+    }
+
+    static bigint bignum(bigint const &lhs, bigint const &rhs)
+    {
+        if (rhs == 0)
+            throw division_by_zero();
+        return lhs % rhs;
+    }
+
+    static double flonum(double lhs, double rhs)
+    {
+        return std::fmod(lhs, rhs);
+    }
+};
+}
+
+// Both operands must be numbers.
+template <class Op>
+inline value arithmetic(value const &lhs, value const &rhs)
+{
+    std::int64_t ret;
+    if (lhs.is<number>() && rhs.is<number>() &&
+        Op::fixnum(lhs.get<number>(), rhs.get<number>(), ret))
+        return value::make<number>(ret);
+    else if (lhs.is<flonum>() || rhs.is<flonum>())
+        return value::make<flonum>(Op::flonum(to_double(lhs), to_double(rhs)));
+    return make_integer(Op::bignum(to_bigint(lhs), to_bigint(rhs)));
+}
+
+// The number a primitive taking numbers accepts in place of val: val itself,
+// an integer spelled out in a string, or either inside a one-element list.
+inline boost::optional<value> to_number(value const &val)
+{
+    auto pos = &val;
+    while (pos->is<pair>() && pos->get<pair>().cdr.is<nil>())
+        pos = &pos->get<pair>().car;
+    if (is_number(*pos))
+        return *pos;
+    else if (is_text(*pos))
+        return parse_integer(text_of(*pos));
+    return boost::none;
+}
+
+namespace number_detail
+{
+template <class T>
+inline int sign_of_difference(T const &lhs, T const &rhs)
+{
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+// Compares an integer with a flonum exactly, rather than after rounding
+// the integer to a double: the integer is compared with the flonum's
+// integral part, and the fraction breaks a tie.
+inline int compare_exact(value const &integer, double d)
+{
+    if (std::isinf(d))
+        return d > 0 ? -1 : 1;
+    auto const whole = std::trunc(d);
+    // 2^63, the first double past the fixnums.
+    auto const limit = 9223372036854775808.0;
+    auto const ret = integer.is<number>() && whole >= -limit && whole < limit
+        ? sign_of_difference(integer.get<number>(), static_cast<std::int64_t>(whole))
+        : to_bigint(integer).compare(bigint(whole));
+    return ret != 0 ? ret : sign_of_difference(whole, d);
+}
+}
+
+// Returns a negative number, zero or a positive number as lhs is less than,
+// equal to or greater than rhs. Both must be numbers, and neither a NaN.
+// An integer and a flonum are compared exactly.
+inline int compare(value const &lhs, value const &rhs)
+{
+    using namespace number_detail;
+    if (lhs.is<number>() && rhs.is<number>())
+        return sign_of_difference(lhs.get<number>(), rhs.get<number>());
+    else if (lhs.is<flonum>() && rhs.is<flonum>())
+        return sign_of_difference(lhs.get<flonum>(), rhs.get<flonum>());
+    else if (rhs.is<flonum>())
+        return compare_exact(lhs, rhs.get<flonum>());
+    else if (lhs.is<flonum>())
+        return -compare_exact(rhs, lhs.get<flonum>());
+    return to_bigint(lhs).compare(to_bigint(rhs));
+}
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef IOLISP_PORT_HPP
+#define IOLISP_PORT_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <ios>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace iolisp
+{
+class task;
+
+// When written output is pushed to the file: after every write, after every
+// write that ends a line, or only when the buffer fills or the port is
+// flushed or closed.
+enum class buffering
+{
+    none,
+    line,
+    block
+};
+
+// A file opened by open-input-file or open-output-file.
+class file_port
+  : public std::fstream
+{
+public:
+    static constexpr std::size_t block_size = 64 * 1024;
+
+    file_port(std::string const &filename, std::ios::openmode mode, buffering policy = buffering::block)
+      : buffer_(policy == buffering::none ? 0 : block_size), policy_(policy)
+    {
+        // The buffer has to be installed before the file is opened.
+        rdbuf()->pubsetbuf(buffer_.empty() ? nullptr : buffer_.data(), buffer_.size());
+        open(filename, mode);
+    }
+
+    // Flushes while the buffer is still alive.
+    ~file_port()
+    {
+        close();
+    }
+
+    buffering policy() const
+    {
+        return policy_;
+    }
+
+    // Held while reading or writing, since tasks on other threads may use
+    // the same port.
+    std::mutex &mutex()
+    {
+        return mutex_;
+    }
+
+private:
+    std::vector<char> buffer_;
+    buffering policy_;
+    std::mutex mutex_;
+};
+
+// Standard output is line buffered when it is a terminal, so that each line
+// appears as it is written, and block buffered otherwise.
+inline buffering stdout_policy()
+{
+    static buffering const policy = ::isatty(STDOUT_FILENO) ? buffering::line : buffering::block;
+    return policy;
+}
+
+// Where the I/O primitives read and write when given no port: standard
+// input and output, or the streams an interpreter was given. Each thread
+// uses the console of the interpreter it runs, and tasks that of the
+// thread that submitted them.
+class console
+{
+public:
+    console(std::istream &in, std::ostream &out, buffering policy)
+      : in_(in), out_(out), policy_(policy), kept_tasks_(0)
+    {}
+
+    console(console const &) = delete;
+    console &operator=(console const &) = delete;
+
+    static console &standard()
+    {
+        static console c(std::cin, std::cout, stdout_policy());
+        return c;
+    }
+
+    static console *&current_pointer()
+    {
+        static thread_local console *current = &standard();
+        return current;
+    }
+
+    static console &current()
+    {
+        return *current_pointer();
+    }
+
+    std::istream &in() const
+    {
+        return in_;
+    }
+
+    std::ostream &out() const
+    {
+        return out_;
+    }
+
+    buffering policy() const
+    {
+        return policy_;
+    }
+
+    // Keeps what one write puts on the output together.
+    std::mutex &mutex()
+    {
+        return mutex_;
+    }
+
+    // Remembers a task submitted with this console current, for end_tasks.
+    // Defined with the thread pool.
+    void started(std::shared_ptr<task> const &t);
+
+    // Drops the tasks started with this console that no thread has begun,
+    // and waits for the rest, so that none runs against it later. Called
+    // when the job using it ends.
+    void end_tasks();
+
+    // Makes a console current on this thread while it lives.
+    class scope
+    {
+    public:
+        explicit scope(console &c)
+          : previous_(current_pointer())
+        {
+            current_pointer() = &c;
+        }
+
+        scope(scope const &) = delete;
+        scope &operator=(scope const &) = delete;
+
+        ~scope()
+        {
+            current_pointer() = previous_;
+        }
+
+    private:
+        console *previous_;
+    };
+
+private:
+    std::istream &in_;
+    std::ostream &out_;
+    buffering policy_;
+    std::mutex mutex_;
+    std::mutex tasks_mutex_;
+    std::vector<std::weak_ptr<task>> tasks_;
+    std::size_t kept_tasks_;
+};
+
+// Applies the policy once something has been written to os.
+inline void written(std::ostream &os, buffering policy, bool ends_line)
+{
+    if (policy == buffering::none || (policy == buffering::line && ends_line))
+        os.flush();
+}
+}
+
+#endif
@@ -1,15 +1,22 @@
 #ifndef IOLISP_PRIMITIVES_HPP
 #define IOLISP_PRIMITIVES_HPP
 
-#include <array>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
-#include <boost/lexical_cast.hpp>
 #include <boost/range/adaptors.hpp>
-#include <boost/range/algorithm_ext/insert.hpp>
 #include <boost/range/functions.hpp>
-#include <boost/range/numeric.hpp>
+#include <boost/utility/string_view.hpp>
+#include "./hash_table.hpp"
+#include "./heap.hpp"
+#include "./number.hpp"
+#include "./simd.hpp"
 #include "./value.hpp"
 
 namespace iolisp
@@ -19,36 +26,26 @@ namespace primitives_detail
 template <class T>
 value::rep<T> unpack(value const &v);
 
-template <>
-inline value::rep<number> unpack<number>(value const &v)
+// Returns a fixnum, bignum or flonum. Strings of digits and one-element
+// lists are converted, as by to_number; an error names the innermost value.
+inline value unpack_number(value const &v)
 {
-    if (v.is<number>())
-        return v.get<number>();
-    else if (v.is<string>())
-        try
-        {
-            return boost::lexical_cast<int>(v.get<string>());
-        }
-        catch (boost::bad_lexical_cast const &)
-        {
-            throw type_mismatch("number", v);
-        }
-    else if (v.is<list>())
-    {
-        auto const &vec = v.get<list>();
-        if (vec.size() == 1)
-            return unpack<number>(vec[0]);
-    }
+    if (is_number(v))
+        return v;
+    else if (auto const n = to_number(v))
+        return *n;
+    else if (v.is<pair>() && v.get<pair>().cdr.is<nil>())
+        return unpack_number(v.get<pair>().car);
     throw type_mismatch("number", v);
 }
 
 template <>
 inline value::rep<string> unpack<string>(value const &v)
 {
-    if (v.is<string>())
-        return v.get<string>();
-    else if (v.is<number>())
-        return boost::lexical_cast<std::string>(v.get<number>());
+    if (is_text(v))
+        return text_of(v).to_string();
+    else if (is_integer(v))
+        return integer_to_string(v);
     else if (v.is<bool_>())
         return v.get<bool_>() ? "True" : "False";
     throw type_mismatch("string", v);
@@ -62,197 +59,750 @@ inline value::rep<bool_> unpack<bool_>(value const &v)
     throw type_mismatch("boolean", v);
 }
 
-inline value numeric_binary_op(std::function<int (int, int)> fn, arguments args)
+template <class Op>
+inline value numeric_binary_op(arguments args)
 {
-    if (boost::size(args) == 1)
+    if (boost::size(args) < 2)
         throw wrong_number_of_arguments(2, args);
-    auto const ns = args | boost::adaptors::transformed(&unpack<number>);
-    return value::make<number>(boost::accumulate(
-        ns | boost::adaptors::sliced(1, boost::size(ns)),
-        *boost::begin(ns),
-        fn));
+    auto acc = unpack_number(args.front());
+    for (auto const &arg : args | boost::adaptors::sliced(1, boost::size(args)))
+        acc = arithmetic<Op>(acc, unpack_number(arg));
+    return acc;
 }
 
-template <class Type>
-inline value bool_binary_op(
-    std::function<bool (value::rep<Type> const &, value::rep<Type> const &)> func,
-    arguments args)
+template <class Op>
+inline value numeric_binary_op2(value const &lhs, value const &rhs)
 {
-    if (boost::size(args) != 2)
-        throw wrong_number_of_arguments(2, args);
-    return value::make<bool_>(func(
-        unpack<Type>(*boost::begin(args)),
-        unpack<Type>(*(boost::begin(args) + 1))));
+    return arithmetic<Op>(unpack_number(lhs), unpack_number(rhs));
+}
+
+template <class Op>
+inline value::primitive_rep numeric_primitive()
+{
+    auto prim = make_primitive(&numeric_binary_op<Op>);
+    prim.call2 = &numeric_binary_op2<Op>;
+    return prim;
+}
+
+// Op is applied to the result of compare and zero. A NaN is unordered, so
+// only /= holds for it.
+template <class Op>
+inline value numeric_compare(value const &lhs, value const &rhs)
+{
+    auto const l = unpack_number(lhs);
+    auto const r = unpack_number(rhs);
+    if (is_nan(l) || is_nan(r))
+        return value::make<bool_>(Op()(1, 0) && Op()(-1, 0));
+    return value::make<bool_>(Op()(compare(l, r), 0));
+}
+
+template <class Type, class Op>
+inline value bool_binary_op(value const &lhs, value const &rhs)
+{
+    return value::make<bool_>(Op()(unpack<Type>(lhs), unpack<Type>(rhs)));
+}
+
+inline value car(value const &val)
+{
+    if (val.is<pair>())
+        return val.get<pair>().car;
+    throw type_mismatch("pair", val);
+}
+
+inline value cdr(value const &val)
+{
+    if (val.is<pair>())
+        return val.get<pair>().cdr;
+    throw type_mismatch("pair", val);
+}
+
+inline value cons(value const &car, value const &cdr)
+{
+    return make_pair(car, cdr);
+}
+
+inline value eqv(value const &lhs, value const &rhs)
+{
+    return value::make<bool_>(is_eqv(lhs, rhs));
+}
+
+inline value equal(value const &lhs, value const &rhs)
+{
+    return value::make<bool_>(is_equal(lhs, rhs));
+}
+
+// The number of elements of a proper list.
+inline std::size_t unpack_list(value const &v)
+{
+    std::size_t n = 0;
+    auto pos = &v;
+    for (; pos->is<pair>(); pos = &pos->get<pair>().cdr)
+        ++n;
+    if (!pos->is<nil>())
+        throw type_mismatch("list", v);
+    return n;
 }
 
-inline value car(arguments args)
+inline value length(value const &lst)
 {
-    if (boost::size(args) == 1)
+    return value::make<number>(static_cast<value::rep<number>>(unpack_list(lst)));
+}
+
+// Every list but the last is copied; the last becomes the tail of the result
+// and may be any value.
+inline value append(arguments args)
+{
+    if (boost::empty(args))
+        return value();
+    auto ret = args[boost::size(args) - 1];
+    for (auto i = boost::size(args) - 1; i-- != 0;)
     {
-        auto const &val = *boost::begin(args);
-        if (val.is<list>())
-        {
-            auto const &vec = val.get<list>();
-            if (!vec.empty())
-                return vec[0];
-        }
-        else if (val.is<dotted_list>())
-        {
-            auto const &init = val.get<dotted_list>().first;
-            if (init.size() == 2)
-                return init[0];
-        }
-        throw type_mismatch("pair", val);
+        unpack_list(args[i]);
+        ret = make_list(list_elements(args[i]), ret);
     }
-    throw wrong_number_of_arguments(1, args);
+    return ret;
+}
+
+inline value reverse(value const &lst)
+{
+    unpack_list(lst);
+    value ret;
+    for (auto const &elem : list_elements(lst))
+        ret = make_pair(elem, ret);
+    return ret;
+}
+
+inline value list_ref(value const &lst, value const &k)
+{
+    if (!k.is<number>())
+        throw type_mismatch("number", k);
+    auto const index = k.get<number>();
+    auto pos = &lst;
+    std::size_t size = 0;
+    for (; pos->is<pair>(); pos = &pos->get<pair>().cdr, ++size)
+        if (static_cast<value::rep<number>>(size) == index)
+            return pos->get<pair>().car;
+    if (!pos->is<nil>())
+        throw type_mismatch("list", lst);
+    throw index_out_of_range(index, size);
 }
 
-inline value cdr(arguments args)
+inline boost::string_view unpack_text(value const &v)
 {
-    if (boost::size(args) == 1)
+    if (is_text(v))
+        return text_of(v);
+    throw type_mismatch("string", v);
+}
+
+inline std::size_t unpack_index(value const &v, std::size_t size)
+{
+    if (!v.is<number>())
+        throw type_mismatch("number", v);
+    auto const index = v.get<number>();
+    if (index < 0 || static_cast<std::size_t>(index) > size)
+        throw index_out_of_range(index, size);
+    return static_cast<std::size_t>(index);
+}
+
+inline std::vector<value> const &unpack_vector(value const &v)
+{
+    if (v.is<vector>())
+        return v.get<vector>();
+    throw type_mismatch("vector", v);
+}
+
+// Vectors are shared, not copied, so changing one through any value that
+// refers to it changes it for all of them. Other threads may be reading it,
+// so the change is made in a heap::exclusive_section unless it is private.
+inline std::vector<value> &mutable_vector(value const &v)
+{
+    return const_cast<std::vector<value> &>(unpack_vector(v));
+}
+
+// The index of an element, which unlike unpack_index excludes size.
+inline std::size_t unpack_element_index(value const &v, std::size_t size)
+{
+    if (!v.is<number>())
+        throw type_mismatch("number", v);
+    auto const index = v.get<number>();
+    if (index < 0 || static_cast<std::size_t>(index) >= size)
+        throw index_out_of_range(index, size);
+    return static_cast<std::size_t>(index);
+}
+
+// (make-vector k [fill]) where fill defaults to #f.
+inline value make_vector(arguments args)
+{
+    if (boost::size(args) != 1 && boost::size(args) != 2)
+        throw wrong_number_of_arguments(1, args);
+    if (!args[0].is<number>())
+        throw type_mismatch("number", args[0]);
+    if (args[0].get<number>() < 0)
+        throw index_out_of_range(args[0].get<number>(), 0);
+    auto const fill = boost::size(args) == 2 ? args[1] : value::make<bool_>(false);
+    return value::make<vector>(std::vector<value>(static_cast<std::size_t>(args[0].get<number>()), fill));
+}
+
+inline value vector_proc(arguments args)
+{
+    return value::make<vector>(std::vector<value>(boost::begin(args), boost::end(args)));
+}
+
+inline value vector_length(value const &v)
+{
+    return value::make<number>(static_cast<value::rep<number>>(unpack_vector(v).size()));
+}
+
+inline value vector_ref(value const &v, value const &k)
+{
+    auto const &elems = unpack_vector(v);
+    return elems[unpack_element_index(k, elems.size())];
+}
+
+// Returns the value stored, as set! does.
+inline value vector_set(arguments args)
+{
+    auto &elems = mutable_vector(args[0]);
+    heap::exclusive_section const section(args[0].is_shared());
+    elems[unpack_element_index(args[1], elems.size())] = args[2];
+    return args[2];
+}
+
+inline value vector_fill(value const &v, value const &fill)
+{
+    auto &elems = mutable_vector(v);
+    heap::exclusive_section const section(v.is_shared());
+    std::fill(elems.begin(), elems.end(), fill);
+    return v;
+}
+
+inline value vector_to_list(value const &v)
+{
+    return make_list(unpack_vector(v));
+}
+
+inline value list_to_vector(value const &lst)
+{
+    std::vector<value> elems;
+    elems.reserve(unpack_list(lst));
+    for (auto const &elem : list_elements(lst))
+        elems.push_back(elem);
+    return value::make<vector>(std::move(elems));
+}
+
+// What differs between f64vectors and s64vectors: the element type, how a
+// value becomes an element and back, and the kernels in simd.hpp.
+struct f64_elements
+{
+    using type = f64vector;
+    using element = double;
+
+    static char const *name()
     {
-        auto const &val = *boost::begin(args);
-        if (val.is<list>())
-        {
-            auto const &vec = val.get<list>();
-            if (!vec.empty())
-                return value::make<list>({vec.begin() + 1, vec.end()});
-        }
-        else if (val.is<dotted_list>())
-        {
-            auto const &init = val.get<dotted_list>().first;
-            auto const &last = val.get<dotted_list>().second;
-            if (init.size() == 1)
-                return last;
-            else if (init.size() >= 2)
-                return value::make<dotted_list>({{init.begin() + 1, init.end()}, last});
-        }
-        throw type_mismatch("pair", val);
+        return "f64vector";
     }
-    throw wrong_number_of_arguments(1, args);
-}
 
-inline value cons(arguments args)
+    static double unpack(value const &v)
+    {
+        if (is_number(v))
+            return to_double(v);
+        throw type_mismatch("number", v);
+    }
+
+    static value pack(double d)
+    {
+        return value::make<flonum>(d);
+    }
+
+    template <class Op, bool Broadcast>
+    static bool map(double const *lhs, double const *rhs, double *out, std::size_t n)
+    {
+        map_f64<Op, Broadcast>(lhs, rhs, out, n);
+        return true;
+    }
+
+    static value sum(double const *first, std::size_t n)
+    {
+        return pack(sum_f64(first, n));
+    }
+
+    static value dot(double const *lhs, double const *rhs, std::size_t n)
+    {
+        return pack(dot_f64(lhs, rhs, n));
+    }
+
+    template <bool Min>
+    static value extremum(double const *first, std::size_t n)
+    {
+        return pack(extremum_f64<Min>(first, n));
+    }
+
+    static bool prefix_sum(double const *first, double *out, std::size_t n)
+    {
+        prefix_sum_f64(first, out, n);
+        return true;
+    }
+};
+
+// Sums and dot products that overflow are computed again with bignums;
+// elementwise results and prefix sums must fit, as they are stored.
+struct s64_elements
 {
-    if (boost::size(args) == 2)
+    using type = s64vector;
+    using element = std::int64_t;
+
+    static char const *name()
     {
-        auto const &head = *boost::begin(args);
-        auto const &tail = *(boost::begin(args) + 1);
-        if (tail.is<list>())
-        {
-            std::vector<value> vec{head};
-            boost::insert(vec, vec.end(), tail.get<list>());
-            return value::make<list>(vec);
-        }
-        else if (tail.is<dotted_list>())
-        {
-            std::vector<value> vec{head};
-            boost::insert(vec, vec.end(), tail.get<dotted_list>().first);
-            return value::make<dotted_list>({vec, tail.get<dotted_list>().second});
-        }
-        else
-            return value::make<dotted_list>({{head}, tail});
+        return "s64vector";
+    }
+
+    static std::int64_t unpack(value const &v)
+    {
+        if (v.is<number>())
+            return v.get<number>();
+        throw type_mismatch("64-bit integer", v);
     }
-    throw wrong_number_of_arguments(2, args);
+
+    static value pack(std::int64_t n)
+    {
+        return value::make<number>(n);
+    }
+
+    template <class Op, bool Broadcast>
+    static bool map(std::int64_t const *lhs, std::int64_t const *rhs, std::int64_t *out, std::size_t n)
+    {
+        return map_s64<Op, Broadcast>(lhs, rhs, out, n);
+    }
+
+    static value sum(std::int64_t const *first, std::size_t n)
+    {
+        std::int64_t ret;
+        if (sum_s64(first, n, ret))
+            return pack(ret);
+        bigint acc = 0;
+        for (std::size_t i = 0; i != n; ++i)
+            acc += first[i];
+        return make_integer(acc);
+    }
+
+    static value dot(std::int64_t const *lhs, std::int64_t const *rhs, std::size_t n)
+    {
+        std::int64_t ret;
+        if (dot_s64(lhs, rhs, n, ret))
+            return pack(ret);
+        bigint acc = 0;
+        for (std::size_t i = 0; i != n; ++i)
+            acc += bigint(lhs[i]) * rhs[i];
+        return make_integer(acc);
+    }
+
+    template <bool Min>
+    static value extremum(std::int64_t const *first, std::size_t n)
+    {
+        return pack(extremum_s64<Min>(first, n));
+    }
+
+    static bool prefix_sum(std::int64_t const *first, std::int64_t *out, std::size_t n)
+    {
+        return prefix_sum_s64(first, out, n);
+    }
+};
+
+template <class Elements>
+inline std::vector<typename Elements::element> const &unpack_numeric_vector(value const &v)
+{
+    if (v.is<typename Elements::type>())
+        return v.get<typename Elements::type>();
+    throw type_mismatch(Elements::name(), v);
+}
+
+template <class Elements>
+inline std::vector<typename Elements::element> &mutable_numeric_vector(value const &v)
+{
+    return const_cast<std::vector<typename Elements::element> &>(unpack_numeric_vector<Elements>(v));
+}
+
+// (make-f64vector k [fill]) where fill defaults to 0.
+template <class Elements>
+inline value make_numeric_vector(arguments args)
+{
+    if (boost::size(args) != 1 && boost::size(args) != 2)
+        throw wrong_number_of_arguments(1, args);
+    if (!args[0].is<number>())
+        throw type_mismatch("number", args[0]);
+    if (args[0].get<number>() < 0)
+        throw index_out_of_range(args[0].get<number>(), 0);
+    auto const fill = boost::size(args) == 2 ? Elements::unpack(args[1]) : 0;
+    return value::make<typename Elements::type>(
+        std::vector<typename Elements::element>(static_cast<std::size_t>(args[0].get<number>()), fill));
+}
+
+template <class Elements>
+inline value numeric_vector_proc(arguments args)
+{
+    std::vector<typename Elements::element> elems;
+    elems.reserve(boost::size(args));
+    for (auto const &arg : args)
+        elems.push_back(Elements::unpack(arg));
+    return value::make<typename Elements::type>(std::move(elems));
 }
 
-inline value eqv(arguments args)
+template <class Elements>
+inline value numeric_vector_length(value const &v)
 {
-    if (boost::size(args) == 2)
+    return value::make<number>(static_cast<value::rep<number>>(unpack_numeric_vector<Elements>(v).size()));
+}
+
+template <class Elements>
+inline value numeric_vector_ref(value const &v, value const &k)
+{
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    return Elements::pack(elems[unpack_element_index(k, elems.size())]);
+}
+
+template <class Elements>
+inline value numeric_vector_set(arguments args)
+{
+    auto &elems = mutable_numeric_vector<Elements>(args[0]);
+    heap::exclusive_section const section(args[0].is_shared());
+    elems[unpack_element_index(args[1], elems.size())] = Elements::unpack(args[2]);
+    return args[2];
+}
+
+template <class Elements>
+inline value numeric_vector_to_list(value const &v)
+{
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    std::vector<value> vals;
+    vals.reserve(elems.size());
+    for (auto const elem : elems)
+        vals.push_back(Elements::pack(elem));
+    return make_list(vals);
+}
+
+template <class Elements>
+inline value list_to_numeric_vector(value const &lst)
+{
+    std::vector<typename Elements::element> elems;
+    elems.reserve(unpack_list(lst));
+    for (auto const &elem : list_elements(lst))
+        elems.push_back(Elements::unpack(elem));
+    return value::make<typename Elements::type>(std::move(elems));
+}
+
+// The other operand of an elementwise operation or dot product, which must
+// be as long as the first.
+template <class Elements>
+inline std::vector<typename Elements::element> const &unpack_same_length(value const &v, std::size_t size)
+{
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    if (elems.size() != size)
+        throw type_mismatch(std::string(Elements::name()) + " of length " + std::to_string(size), v);
+    return elems;
+}
+
+// (f64vector-add v w) where w is a vector of the same length or a number,
+// which is used for every element.
+template <class Elements, class Op>
+inline value numeric_vector_map(value const &lhs, value const &rhs)
+{
+    auto const &l = unpack_numeric_vector<Elements>(lhs);
+    std::vector<typename Elements::element> ret(l.size());
+    auto ok = false;
+    if (rhs.is<typename Elements::type>())
+        ok = Elements::template map<Op, false>(
+            l.data(), unpack_same_length<Elements>(rhs, l.size()).data(), ret.data(), l.size());
+    else
     {
-        auto const &lhs = *boost::begin(args);
-        auto const &rhs = *(boost::begin(args) + 1);
-        if (lhs.is<bool_>() && rhs.is<bool_>())
-            return value::make<bool_>(lhs.get<bool_>() == rhs.get<bool_>());
-        else if (lhs.is<number>() && rhs.is<number>())
-            return value::make<bool_>(lhs.get<number>() == rhs.get<number>());
-        else if (lhs.is<string>() && rhs.is<string>())
-            return value::make<bool_>(lhs.get<string>() == rhs.get<string>());
-        else if (lhs.is<atom>() && rhs.is<atom>())
-            return value::make<bool_>(lhs.get<atom>() == rhs.get<atom>());
-        else if (lhs.is<dotted_list>() && rhs.is<dotted_list>())
-        {
-            auto const to_list = [](value const &val) -> value
-            {
-                auto vec = val.get<dotted_list>().first;
-                vec.push_back(val.get<dotted_list>().second);
-                return value::make<list>(vec);
-            };
-            return eqv(std::array<value, 2>{{to_list(lhs), to_list(rhs)}});
-        }
-        else if (lhs.is<list>() && rhs.is<list>())
-            return value::make<bool_>(boost::equal(
-                lhs.get<list>(),
-                rhs.get<list>(),
-                [](value const &val1, value const &val2) -> bool
-                {
-                    auto const res = eqv(std::array<value, 2>{{val1, val2}});
-                    BOOST_ASSERT(res.is<bool_>());
-                    return res.get<bool_>();
-                }));
-        return value::make<bool_>(false);
+        auto const r = Elements::unpack(rhs);
+        ok = Elements::template map<Op, true>(l.data(), &r, ret.data(), l.size());
     }
-    throw wrong_number_of_arguments(2, args);
+    if (!ok)
+        throw integer_overflow(Elements::name());
+    return value::make<typename Elements::type>(std::move(ret));
+}
+
+template <class Elements>
+inline value numeric_vector_dot(value const &lhs, value const &rhs)
+{
+    auto const &l = unpack_numeric_vector<Elements>(lhs);
+    return Elements::dot(l.data(), unpack_same_length<Elements>(rhs, l.size()).data(), l.size());
 }
 
-template <class Type>
-inline bool unpack_equals(value const &lhs, value const &rhs)
-try
+template <class Elements>
+inline value numeric_vector_sum(value const &v)
 {
-    return unpack<Type>(lhs) == unpack<Type>(rhs);
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    return Elements::sum(elems.data(), elems.size());
 }
-catch (type_mismatch const &)
+
+template <class Elements, bool Min>
+inline value numeric_vector_extremum(value const &v)
 {
-    return false;
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    if (elems.empty())
+        throw type_mismatch(std::string("non-empty ") + Elements::name(), v);
+    return Elements::template extremum<Min>(elems.data(), elems.size());
 }
 
-inline value equal(arguments args)
+template <class Elements>
+inline value numeric_vector_prefix_sum(value const &v)
 {
-    if (boost::size(args) == 2)
+    auto const &elems = unpack_numeric_vector<Elements>(v);
+    std::vector<typename Elements::element> ret(elems.size());
+    if (!Elements::prefix_sum(elems.data(), ret.data(), elems.size()))
+        throw integer_overflow(Elements::name());
+    return value::make<typename Elements::type>(std::move(ret));
+}
+
+template <class Elements>
+inline void add_numeric_vector_primitives(std::map<std::string, value::primitive_rep> &prims)
+{
+    std::string const name = Elements::name();
+    prims.insert({
+        {"make-" + name, make_primitive(&make_numeric_vector<Elements>)},
+        {name, make_primitive(&numeric_vector_proc<Elements>)},
+        {name + "-length", make_unary_primitive<&numeric_vector_length<Elements>>()},
+        {name + "-ref", make_binary_primitive<&numeric_vector_ref<Elements>>()},
+        {name + "-set!", make_primitive(&numeric_vector_set<Elements>, 3)},
+        {name + "->list", make_unary_primitive<&numeric_vector_to_list<Elements>>()},
+        {"list->" + name, make_unary_primitive<&list_to_numeric_vector<Elements>>()},
+        {name + "-add", make_binary_primitive<&numeric_vector_map<Elements, number_detail::add>>()},
+        {name + "-sub", make_binary_primitive<&numeric_vector_map<Elements, number_detail::subtract>>()},
+        {name + "-mul", make_binary_primitive<&numeric_vector_map<Elements, number_detail::multiply>>()},
+        {name + "-dot", make_binary_primitive<&numeric_vector_dot<Elements>>()},
+        {name + "-sum", make_unary_primitive<&numeric_vector_sum<Elements>>()},
+        {name + "-min", make_unary_primitive<&numeric_vector_extremum<Elements, true>>()},
+        {name + "-max", make_unary_primitive<&numeric_vector_extremum<Elements, false>>()},
+        {name + "-prefix-sum", make_unary_primitive<&numeric_vector_prefix_sum<Elements>>()}});
+}
+
+inline equivalence unpack_equivalence(value const &v)
+{
+    if (v.is<atom>())
     {
-        auto const &lhs = *boost::begin(args);
-        auto const &rhs = *(boost::begin(args) + 1);
-        if (unpack_equals<number>(lhs, rhs) ||
-            unpack_equals<string>(lhs, rhs) ||
-            unpack_equals<bool_>(lhs, rhs))
-            return value::make<bool_>(true);
-        return eqv(std::array<value, 2>{{lhs, rhs}});
+        auto const &name = v.get<atom>().name();
+        if (name == "eq" || name == "eq?")
+            return equivalence::eq;
+        else if (name == "eqv" || name == "eqv?")
+            return equivalence::eqv;
+        else if (name == "equal" || name == "equal?")
+            return equivalence::equal;
     }
-    throw wrong_number_of_arguments(2, args);
+    throw type_mismatch("eq, eqv or equal", v);
+}
+
+inline hash_table_rep const &unpack_hash_table(value const &v)
+{
+    if (v.is<hash_table>())
+        return v.get<hash_table>();
+    throw type_mismatch("hash table", v);
+}
+
+// Tables are shared like vectors.
+inline hash_table_rep &mutable_hash_table(value const &v)
+{
+    return const_cast<hash_table_rep &>(unpack_hash_table(v));
+}
+
+// (make-hash-table [kind]) where kind is the symbol eq, eqv or equal, and
+// defaults to equal. An eq table compares keys by identity, unlike eq?,
+// which is eqv?.
+inline value make_hash_table(arguments args)
+{
+    if (boost::size(args) > 1)
+        throw wrong_number_of_arguments(1, args);
+    return value::make<hash_table>(
+        hash_table_rep(boost::empty(args) ? equivalence::equal : unpack_equivalence(args[0])));
+}
+
+// (hash-table-ref table key [default]) where a missing key without a
+// default is an error.
+inline value hash_table_ref(arguments args)
+{
+    if (boost::size(args) != 2 && boost::size(args) != 3)
+        throw wrong_number_of_arguments(2, args);
+    if (auto const val = unpack_hash_table(args[0]).find(args[1]))
+        return *val;
+    else if (boost::size(args) == 3)
+        return args[2];
+    throw key_not_found(args[1]);
+}
+
+// Returns the value stored, as vector-set! does.
+inline value hash_table_set(arguments args)
+{
+    auto &table = mutable_hash_table(args[0]);
+    heap::exclusive_section const section(args[0].is_shared());
+    table.set(args[1], args[2]);
+    return args[2];
+}
+
+inline value hash_table_delete(value const &table, value const &key)
+{
+    auto &rep = mutable_hash_table(table);
+    heap::exclusive_section const section(table.is_shared());
+    return value::make<bool_>(rep.erase(key));
+}
+
+inline value hash_table_contains(value const &table, value const &key)
+{
+    return value::make<bool_>(unpack_hash_table(table).find(key) != nullptr);
+}
+
+inline value hash_table_count(value const &table)
+{
+    return value::make<number>(static_cast<value::rep<number>>(unpack_hash_table(table).size()));
+}
+
+// The entries, in no particular order, as keys, values or (key . value)
+// pairs.
+template <class Entry>
+inline value hash_table_entries(value const &table, Entry const &entry)
+{
+    auto const &rep = unpack_hash_table(table);
+    std::vector<value> entries;
+    entries.reserve(rep.size());
+    rep.for_each(
+        [&](value const &key, value const &val)
+        {
+            entries.push_back(entry(key, val));
+        });
+    return make_list(entries);
+}
+
+inline value hash_table_keys(value const &table)
+{
+    return hash_table_entries(table, [](value const &key, value const &) { return key; });
+}
+
+inline value hash_table_values(value const &table)
+{
+    return hash_table_entries(table, [](value const &, value const &val) { return val; });
+}
+
+inline value hash_table_to_alist(value const &table)
+{
+    return hash_table_entries(table, &make_pair);
+}
+
+inline value string_length(value const &s)
+{
+    return value::make<number>(static_cast<value::rep<number>>(unpack_text(s).size()));
+}
+
+// The result is a slice of the original characters, never a copy. A slice
+// of a plain string keeps that string alive through its owner.
+inline value substring(arguments args)
+{
+    auto const &s = args[0];
+    auto const text = unpack_text(s);
+    auto const end = unpack_index(args[2], text.size());
+    auto const start = unpack_index(args[1], end);
+    auto owner = s.is<string_slice>()
+        ? s.get<string_slice>().owner
+        : std::make_shared<value const>(s);
+    return value::make<string_slice>(value::slice_rep{std::move(owner), text.substr(start, end - start)});
+}
+
+// (string-search string pattern [start]) returns the index of the first
+// occurrence of pattern at or after start, or #f.
+inline value string_search(arguments args)
+{
+    if (boost::size(args) != 2 && boost::size(args) != 3)
+        throw wrong_number_of_arguments(2, args);
+    auto const text = unpack_text(args[0]);
+    auto const pattern = unpack_text(args[1]);
+    auto const start = boost::size(args) == 3 ? unpack_index(args[2], text.size()) : 0;
+    auto const pos = text.find(pattern, start);
+    if (pos == boost::string_view::npos)
+        return value::make<bool_>(false);
+    return value::make<number>(static_cast<value::rep<number>>(pos));
+}
+
+inline value collect_garbage(arguments)
+{
+    heap::current().collect();
+    return value::make<bool_>(true);
+}
+
+inline value gc_statistics(arguments)
+{
+    auto const &stats = heap::current().stats();
+    auto const entry = [](char const *name, std::size_t n)
+    {
+        return make_pair(value::make<atom>(symbol(name)), value::make<number>(static_cast<value::rep<number>>(n)));
+    };
+    return make_list({
+        entry("collections", stats.collections),
+        entry("live-objects", stats.live_objects),
+        entry("live-bytes", stats.live_bytes),
+        entry("freed-objects", stats.freed_objects),
+        entry("last-pause-us", stats.last_pause.count()),
+        entry("max-pause-us", stats.max_pause.count()),
+        entry("total-pause-us", stats.total_pause.count())});
 }
 }
 
-inline std::map<std::string, std::function<value (arguments)>> primitives()
+inline std::map<std::string, value::primitive_rep> primitives()
 {
     using namespace primitives_detail;
-    using namespace std::placeholders;
-    return {
-        {"+", std::bind(&numeric_binary_op, std::plus<int>(), _1)},
-        {"-", std::bind(&numeric_binary_op, std::minus<int>(), _1)},
-        {"*", std::bind(&numeric_binary_op, std::multiplies<int>(), _1)},
-        {"/", std::bind(&numeric_binary_op, std::divides<int>(), _1)},
-        {"mod", std::bind(&numeric_binary_op, std::modulus<int>(), _1)},
-        {"quotient", std::bind(&numeric_binary_op, std::divides<int>(), _1)},
-        {"remainder", std::bind(&numeric_binary_op, std::modulus<int>(), _1)},
-        {"=", std::bind(&bool_binary_op<number>, std::equal_to<int>(), _1)},
-        {"<", std::bind(&bool_binary_op<number>, std::less<int>(), _1)},
-        {">", std::bind(&bool_binary_op<number>, std::greater<int>(), _1)},
-        {"/=", std::bind(&bool_binary_op<number>, std::not_equal_to<int>(), _1)},
-        {">=", std::bind(&bool_binary_op<number>, std::greater_equal<int>(), _1)},
-        {"<=", std::bind(&bool_binary_op<number>, std::less_equal<int>(), _1)},
-        {"&&", std::bind(&bool_binary_op<bool_>, std::logical_and<bool>(), _1)},
-        {"||", std::bind(&bool_binary_op<bool_>, std::logical_or<bool>(), _1)},
-        {"string=?", std::bind(&bool_binary_op<string>, std::equal_to<std::string>(), _1)},
-        {"string<?", std::bind(&bool_binary_op<string>, std::less<std::string>(), _1)},
-        {"string>?", std::bind(&bool_binary_op<string>, std::greater<std::string>(), _1)},
-        {"string<=?", std::bind(&bool_binary_op<string>, std::less_equal<std::string>(), _1)},
-        {"string>=?", std::bind(&bool_binary_op<string>, std::greater_equal<std::string>(), _1)},
-        {"car", &car},
-        {"cdr", &cdr},
-        {"cons", &cons},
-        {"eq?", &eqv},
-        {"eqv?", &eqv},
-        {"equal?", &equal}};
+    std::map<std::string, value::primitive_rep> ret{
+        {"+", numeric_primitive<number_detail::add>()},
+        {"-", numeric_primitive<number_detail::subtract>()},
+        {"*", numeric_primitive<number_detail::multiply>()},
+        {"/", numeric_primitive<number_detail::divide>()},
+        {"mod", numeric_primitive<number_detail::remainder>()},
+        {"quotient", numeric_primitive<number_detail::quotient>()},
+        {"remainder", numeric_primitive<number_detail::remainder>()},
+        {"=", make_binary_primitive<&numeric_compare<std::equal_to<int>>>()},
+        {"<", make_binary_primitive<&numeric_compare<std::less<int>>>()},
+        {">", make_binary_primitive<&numeric_compare<std::greater<int>>>()},
+        {"/=", make_binary_primitive<&numeric_compare<std::not_equal_to<int>>>()},
+        {">=", make_binary_primitive<&numeric_compare<std::greater_equal<int>>>()},
+        {"<=", make_binary_primitive<&numeric_compare<std::less_equal<int>>>()},
+        {"&&", make_binary_primitive<&bool_binary_op<bool_, std::logical_and<bool>>>()},
+        {"||", make_binary_primitive<&bool_binary_op<bool_, std::logical_or<bool>>>()},
+        {"string=?", make_binary_primitive<&bool_binary_op<string, std::equal_to<std::string>>>()},
+        {"string<?", make_binary_primitive<&bool_binary_op<string, std::less<std::string>>>()},
+        {"string>?", make_binary_primitive<&bool_binary_op<string, std::greater<std::string>>>()},
+        {"string<=?", make_binary_primitive<&bool_binary_op<string, std::less_equal<std::string>>>()},
+        {"string>=?", make_binary_primitive<&bool_binary_op<string, std::greater_equal<std::string>>>()},
+        {"car", make_unary_primitive<&car>()},
+        {"cdr", make_unary_primitive<&cdr>()},
+        {"cons", make_binary_primitive<&cons>()},
+        {"eq?", make_binary_primitive<&eqv>()},
+        {"eqv?", make_binary_primitive<&eqv>()},
+        {"equal?", make_binary_primitive<&equal>()},
+        {"length", make_unary_primitive<&length>()},
+        {"append", make_primitive(&append)},
+        {"reverse", make_unary_primitive<&reverse>()},
+        {"list-ref", make_binary_primitive<&list_ref>()},
+        {"make-vector", make_primitive(&make_vector)},
+        {"vector", make_primitive(&vector_proc)},
+        {"vector-length", make_unary_primitive<&vector_length>()},
+        {"vector-ref", make_binary_primitive<&vector_ref>()},
+        {"vector-set!", make_primitive(&vector_set, 3)},
+        {"vector-fill!", make_binary_primitive<&vector_fill>()},
+        {"vector->list", make_unary_primitive<&vector_to_list>()},
+        {"list->vector", make_unary_primitive<&list_to_vector>()},
+        {"make-hash-table", make_primitive(&make_hash_table)},
+        {"hash-table-ref", make_primitive(&hash_table_ref)},
+        {"hash-table-set!", make_primitive(&hash_table_set, 3)},
+        {"hash-table-delete!", make_binary_primitive<&hash_table_delete>()},
+        {"hash-table-contains?", make_binary_primitive<&hash_table_contains>()},
+        {"hash-table-count", make_unary_primitive<&hash_table_count>()},
+        {"hash-table-keys", make_unary_primitive<&hash_table_keys>()},
+        {"hash-table-values", make_unary_primitive<&hash_table_values>()},
+        {"hash-table->alist", make_unary_primitive<&hash_table_to_alist>()},
+        {"string-length", make_unary_primitive<&string_length>()},
+        {"substring", make_primitive(&substring, 3)},
+        {"string-search", make_primitive(&string_search)},
+        {"collect-garbage", make_primitive(&collect_garbage, 0)},
+        {"gc-stats", make_primitive(&gc_statistics, 0)}};
+    add_numeric_vector_primitives<f64_elements>(ret);
+    add_numeric_vector_primitives<s64_elements>(ret);
+    return ret;
 }
 }
 #endif
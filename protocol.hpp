@@ -0,0 +1,135 @@
+#ifndef IOLISP_PROTOCOL_HPP
+#define IOLISP_PROTOCOL_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace iolisp
+{
+// What iolisp --serve and iolisp-client say to each other over a Unix
+// domain socket. Every message is a frame: a kind byte, a 4-byte
+// little-endian length and the payload.
+//
+// The client sends one request frame, holding strings each with a 4-byte
+// length: the absolute path of the script, then the script's arguments.
+// The server answers with output and error frames as the script writes,
+// and ends with a status frame holding the exit status, 0 or 1, as text.
+namespace protocol
+{
+static constexpr std::size_t max_payload = 64 * 1024 * 1024;
+
+enum frame_kind : char
+{
+    request = 'r',
+    output = 'o',
+    error_output = 'e',
+    status = 's'
+};
+
+// Writes to a socket never raise SIGPIPE; a peer that has gone is an
+// error like any other.
+inline bool write_all(int fd, char const *data, std::size_t size)
+{
+    while (size != 0)
+    {
+        auto const n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+inline bool read_all(int fd, char *data, std::size_t size)
+{
+    while (size != 0)
+    {
+        auto const n = ::read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+inline void put_length(std::string &out, std::size_t size)
+{
+    for (auto i = 0; i != 4; ++i)
+        out += static_cast<char>((size >> (8 * i)) & 0xff);
+}
+
+inline std::size_t get_length(char const *in)
+{
+    std::size_t ret = 0;
+    for (auto i = 0; i != 4; ++i)
+        ret |= static_cast<std::size_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return ret;
+}
+
+inline bool send_frame(int fd, frame_kind kind, char const *data, std::size_t size)
+{
+    std::string header(1, static_cast<char>(kind));
+    put_length(header, size);
+    return write_all(fd, header.data(), header.size()) && write_all(fd, data, size);
+}
+
+inline bool send_frame(int fd, frame_kind kind, std::string const &payload)
+{
+    return send_frame(fd, kind, payload.data(), payload.size());
+}
+
+inline bool receive_frame(int fd, char &kind, std::string &payload)
+{
+    char header[5];
+    if (!read_all(fd, header, sizeof(header)))
+        return false;
+    kind = header[0];
+    auto const size = get_length(header + 1);
+    if (size > max_payload)
+        return false;
+    payload.resize(size);
+    return payload.empty() || read_all(fd, &payload[0], payload.size());
+}
+
+inline std::string pack_strings(std::vector<std::string> const &strs)
+{
+    std::string ret;
+    for (auto const &str : strs)
+    {
+        put_length(ret, str.size());
+        ret += str;
+    }
+    return ret;
+}
+
+// Returns false if the strings run past the end of payload.
+inline bool unpack_strings(std::string const &payload, std::vector<std::string> &strs)
+{
+    for (std::size_t pos = 0; pos != payload.size();)
+    {
+        if (payload.size() - pos < 4)
+            return false;
+        auto const size = get_length(payload.data() + pos);
+        pos += 4;
+        if (payload.size() - pos < size)
+            return false;
+        strs.push_back(payload.substr(pos, size));
+        pos += size;
+    }
+    return true;
+}
+}
+}
+
+#endif
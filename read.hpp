@@ -1,14 +1,21 @@
 #ifndef IOLISP_READ_HPP
 #define IOLISP_READ_HPP
 
+#include <cstddef>
 #include <ios>
+#include <sstream>
 #include <istream>
 #include <string>
 #include <vector>
+#include <boost/optional.hpp>
+#include <boost/range/iterator_range.hpp>
 #include <boost/spirit/include/phoenix.hpp>
 #include <boost/spirit/include/qi.hpp>
 #include <boost/spirit/include/support_istream_iterator.hpp>
+#include <boost/utility/string_view.hpp>
 #include "./errors.hpp"
+#include "./number.hpp"
+#include "./symbol.hpp"
 #include "./value.hpp"
 
 namespace iolisp
@@ -19,6 +26,21 @@ namespace ascii = boost::spirit::ascii;
 namespace phx = boost::phoenix;
 namespace qi = boost::spirit::qi;
 
+// Tokens read from a string are used straight from the input.
+inline boost::string_view token_text(
+    boost::iterator_range<std::string::const_iterator> const &rng,
+    std::string &)
+{
+    return {&*rng.begin(), static_cast<std::size_t>(rng.size())};
+}
+
+template <class Iterator>
+inline boost::string_view token_text(boost::iterator_range<Iterator> const &rng, std::string &buf)
+{
+    buf.assign(rng.begin(), rng.end());
+    return buf;
+}
+
 template <class Iterator>
 class value_grammar
   : public qi::grammar<Iterator, value (), ascii::space_type>
@@ -29,16 +51,18 @@ public:
     {
         symbol_ = ascii::char_("!#$%&|*+/:<=>?@^_~") | ascii::char_('-');
 
-        atom_ = qi::lexeme[qi::as_string[(ascii::alpha | symbol_) >> *(ascii::alnum | symbol_)][
+        atom_ = qi::lexeme[qi::raw[(ascii::alpha | symbol_) >> *(ascii::alnum | symbol_)][
             phx::bind(
-                [](value &val, std::string const &attr)
+                [](value &val, boost::iterator_range<Iterator> const &attr)
                 {
-                    if (attr == "#t")
+                    std::string buf;
+                    auto const name = token_text(attr, buf);
+                    if (name == "#t")
                         val = value::make<bool_>(true);
-                    else if (attr == "#f")
+                    else if (name == "#f")
                         val = value::make<bool_>(false);
                     else
-                        val = value::make<atom>(attr);
+                        val = value::make<atom>(symbol(name));
                 },
                 qi::_val, qi::_1)]];
 
@@ -46,7 +70,7 @@ public:
             phx::bind(
                 [](value &val, std::vector<value> const &attr)
                 {
-                    val = value::make<list>(attr);
+                    val = make_list(attr);
                 },
                 qi::_val, qi::_1)];
 
@@ -54,7 +78,7 @@ public:
             phx::bind(
                 [](value &val, std::vector<value> const &init, value const &last)
                 {
-                    val = value::make<dotted_list>({init, last});
+                    val = make_list(init, last);
                 },
                 qi::_val, qi::_1, qi::_2)];
 
@@ -66,11 +90,58 @@ public:
                 },
                 qi::_val, qi::_1)]];
 
-        number_ = qi::uint_[
+        number_ = qi::lexeme[qi::raw[
+            (ascii::char_("+-") >> (qi::lit("inf.0") | qi::lit("nan.0"))) |
+            (-ascii::char_("+-") >>
+                +ascii::digit >>
+                -('.' >> +ascii::digit) >>
+                -(ascii::char_("eE") >> -ascii::char_("+-") >> +ascii::digit))]][
             phx::bind(
-                [](value &val, unsigned int attr)
+                [](value &val, boost::iterator_range<Iterator> const &attr)
                 {
-                    val = value::make<number>(attr);
+                    std::string buf;
+                    val = *parse_number(token_text(attr, buf));
+                },
+                qi::_val, qi::_1)];
+
+        vector_ = (qi::lit("#(") >> *expr_ >> ')')[
+            phx::bind(
+                [](value &val, std::vector<value> const &attr)
+                {
+                    val = value::make<vector>(attr);
+                },
+                qi::_val, qi::_1)];
+
+        f64vector_ = (qi::lit("#f64(") > *number_ > ')')[
+            phx::bind(
+                [](value &val, std::vector<value> const &attr)
+                {
+                    std::vector<double> elems;
+                    for (auto const &elem : attr)
+                        elems.push_back(to_double(elem));
+                    val = value::make<f64vector>(std::move(elems));
+                },
+                qi::_val, qi::_1)];
+
+        // An element that is not a fixnum ends the elements, so the closing
+        // parenthesis is reported missing there.
+        fixnum_ = number_[
+            phx::bind(
+                [](value &val, value const &attr, bool &pass)
+                {
+                    val = attr;
+                    pass = attr.is<number>();
+                },
+                qi::_val, qi::_1, qi::_pass)];
+
+        s64vector_ = (qi::lit("#s64(") > *fixnum_ > ')')[
+            phx::bind(
+                [](value &val, std::vector<value> const &attr)
+                {
+                    std::vector<std::int64_t> elems;
+                    for (auto const &elem : attr)
+                        elems.push_back(elem.get<number>());
+                    val = value::make<s64vector>(std::move(elems));
                 },
                 qi::_val, qi::_1)];
 
@@ -78,11 +149,13 @@ public:
             phx::bind(
                 [](value &val, value const &attr)
                 {
-                    val = value::make<list>({value::make<atom>("quote"), attr});
+                    val = make_list({value::make<atom>(symbol("quote")), attr});
                 },
                 qi::_val, qi::_1)];
 
-        expr_ = atom_ | list_ | dotted_list_ | string_ | number_ | quoted_;
+        // #(, #f64( and #s64( would otherwise be read as an atom and a list,
+        // and a signed number as an atom.
+        expr_ = vector_ | f64vector_ | s64vector_ | number_ | atom_ | list_ | dotted_list_ | string_ | quoted_;
 
         expr_.name("expr");
 
@@ -103,19 +176,381 @@ public:
         return error_;
     }
 
+    void clear_error()
+    {
+        error_.clear();
+    }
+
 private:
     qi::rule<Iterator, value (), ascii::space_type>
-    expr_, atom_, list_, dotted_list_, string_, number_, quoted_;
+    expr_, atom_, list_, dotted_list_, vector_, f64vector_, s64vector_, string_, number_, fixnum_, quoted_;
     qi::rule<Iterator, char ()> symbol_;
     std::string error_;
 };
+
+// Building the rules costs more than parsing a short expression, so each
+// thread keeps one grammar per iterator type and reuses it.
+template <class Iterator>
+inline value_grammar<Iterator> &grammar()
+{
+    static thread_local value_grammar<Iterator> expr;
+    expr.clear_error();
+    return expr;
 }
+}
+
+// Reads data one at a time, in a single pass with no backtracking. It
+// accepts the same syntax as value_grammar, and is what loading a file
+// uses; the grammar remains for reading REPL input.
+//
+// A reader either scans a contiguous buffer in place, or pulls chunks from
+// a stream into its own buffer. A streaming reader drops each datum's text
+// once the datum has been read, so it only holds the datum in progress.
+class reader
+{
+public:
+    reader(char const *first, char const *last)
+      : source_(nullptr), data_(first), size_(last - first),
+        pos_(0), mark_(0), base_(0), line_(1), line_start_(0)
+    {}
+
+    explicit reader(std::istream &source)
+      : source_(&source), data_(nullptr), size_(0),
+        pos_(0), mark_(0), base_(0), line_(1), line_start_(0)
+    {}
+
+    reader(reader const &) = delete;
+    reader &operator=(reader const &) = delete;
+
+    // Returns the next datum, or none at the end of the input.
+    boost::optional<value> next()
+    {
+        mark_ = pos_;
+        skip_space();
+        mark_ = pos_;
+        if (at_end())
+            return boost::none;
+        return read_expr();
+    }
+
+private:
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    static bool is_space(char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    static bool is_digit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_alpha(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool is_symbol(char c)
+    {
+        switch (c)
+        {
+        case '!': case '#': case '$': case '%': case '&': case '|': case '*':
+        case '+': case '/': case ':': case '<': case '=': case '>': case '?':
+        case '@': case '^': case '_': case '~': case '-':
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool at_end()
+    {
+        return pos_ == size_ && !refill();
+    }
+
+    // Drops the text before the datum in progress and appends the next
+    // chunk of the stream.
+    bool refill()
+    {
+        if (!source_ || !*source_)
+            return false;
+        auto const keep = mark_;
+        buffer_.erase(0, keep);
+        base_ += keep;
+        pos_ -= keep;
+        mark_ -= keep;
+        auto const old_size = buffer_.size();
+        buffer_.resize(old_size + chunk_size);
+        source_->read(&buffer_[old_size], chunk_size);
+        buffer_.resize(old_size + static_cast<std::size_t>(source_->gcount()));
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        return size_ != old_size;
+    }
+
+    // Token starts are taken as stream offsets, which stay valid when a
+    // refill moves the buffer.
+    std::size_t offset() const
+    {
+        return base_ + pos_;
+    }
+
+    boost::string_view text(std::size_t first) const
+    {
+        return {data_ + (first - base_), offset() - first};
+    }
+
+    // The character ahead of the current one, or '\0' past the end.
+    char peek(std::size_t ahead)
+    {
+        while (pos_ + ahead >= size_)
+            if (!refill())
+                return '\0';
+        return data_[pos_ + ahead];
+    }
+
+    void skip_space()
+    {
+        for (; !at_end() && is_space(data_[pos_]); ++pos_)
+            if (data_[pos_] == '\n')
+                new_line();
+    }
+
+    void new_line()
+    {
+        ++line_;
+        line_start_ = offset() + 1;
+    }
+
+    [[noreturn]] void fail(char const *expected) const
+    {
+        std::ostringstream oss;
+        oss << "line " << line_ << ", column " << (offset() - line_start_ + 1) << ": expecting " << expected;
+        throw parse_error(oss.str());
+    }
+
+    value read_expr()
+    {
+        if (at_end())
+            fail("expression");
+        auto const c = data_[pos_];
+        if (c == '#' && peek(1) == '(')
+            return read_vector();
+        else if (ahead("#f64("))
+            return read_numeric_vector<f64vector>();
+        else if (ahead("#s64("))
+            return read_numeric_vector<s64vector>();
+        else if (at_number())
+            return read_number();
+        else if (is_alpha(c) || is_symbol(c))
+            return read_atom();
+        else if (c == '(')
+            return read_list();
+        else if (c == '"')
+            return read_string();
+        else if (c == '\'')
+            return read_quoted();
+        fail("expression");
+    }
+
+    value read_atom()
+    {
+        auto const first = offset();
+        while (!at_end() && (is_alpha(data_[pos_]) || is_digit(data_[pos_]) || is_symbol(data_[pos_])))
+            ++pos_;
+        auto const name = text(first);
+        if (name == "#t")
+            return value::make<bool_>(true);
+        else if (name == "#f")
+            return value::make<bool_>(false);
+        return value::make<atom>(symbol(name));
+    }
+
+    // Whether text is ahead of the current character by skip characters.
+    bool ahead(char const *text, std::size_t skip = 0)
+    {
+        for (std::size_t i = 0; text[i] != '\0'; ++i)
+            if (peek(skip + i) != text[i])
+                return false;
+        return true;
+    }
+
+    // A digit, or a sign followed by a digit, inf.0 or nan.0.
+    bool at_number()
+    {
+        auto const c = data_[pos_];
+        if (is_digit(c))
+            return true;
+        return (c == '+' || c == '-') &&
+            (is_digit(peek(1)) || ahead("inf.0", 1) || ahead("nan.0", 1));
+    }
+
+    // An optional sign and digits, then optionally a fraction and an
+    // exponent, which make the number a flonum; or a signed inf.0 or nan.0.
+    // A dot that is not followed by a digit is left alone, so (1 . 2) is
+    // still a dotted pair.
+    value read_number()
+    {
+        auto const first = offset();
+        if ((data_[pos_] == '+' || data_[pos_] == '-') && !is_digit(peek(1)))
+        {
+            pos_ += 6;
+            return *parse_number(text(first));
+        }
+        else if (data_[pos_] == '+' || data_[pos_] == '-')
+            ++pos_;
+        skip_digits();
+        if (!at_end() && data_[pos_] == '.' && is_digit(peek(1)))
+        {
+            ++pos_;
+            skip_digits();
+        }
+        if (!at_end() && (data_[pos_] == 'e' || data_[pos_] == 'E'))
+        {
+            auto const sign = peek(1) == '+' || peek(1) == '-';
+            if (is_digit(peek(sign ? 2 : 1)))
+            {
+                pos_ += sign ? 2 : 1;
+                skip_digits();
+            }
+        }
+        return *parse_number(text(first));
+    }
+
+    void skip_digits()
+    {
+        while (!at_end() && is_digit(data_[pos_]))
+            ++pos_;
+    }
+
+    // The elements are consed on as they are read, so a dotted list needs
+    // no second pass.
+    value read_list()
+    {
+        ++pos_;
+        value head;
+        auto tail = &head;
+        while (true)
+        {
+            skip_space();
+            if (at_end())
+                fail("')'");
+            else if (data_[pos_] == ')')
+                break;
+            else if (data_[pos_] == '.')
+            {
+                ++pos_;
+                skip_space();
+                *tail = read_expr();
+                skip_space();
+                if (at_end() || data_[pos_] != ')')
+                    fail("')'");
+                break;
+            }
+            *tail = make_pair(read_expr(), value());
+            tail = &tail->get<pair>().cdr;
+        }
+        ++pos_;
+        return head;
+    }
+
+    value read_vector()
+    {
+        pos_ += 2;
+        std::vector<value> elems;
+        while (true)
+        {
+            skip_space();
+            if (at_end())
+                fail("')'");
+            else if (data_[pos_] == ')')
+                break;
+            elems.push_back(read_expr());
+        }
+        ++pos_;
+        return value::make<vector>(std::move(elems));
+    }
+
+    static bool element(value const &num, double &ret)
+    {
+        ret = to_double(num);
+        return true;
+    }
+
+    static bool element(value const &num, std::int64_t &ret)
+    {
+        if (!num.is<number>())
+            return false;
+        ret = num.get<number>();
+        return true;
+    }
+
+    // #f64( or #s64( and numbers; an s64vector takes only fixnums.
+    template <class Type>
+    value read_numeric_vector()
+    {
+        pos_ += 5;
+        value::rep<Type> elems;
+        while (true)
+        {
+            skip_space();
+            if (at_end())
+                fail("')'");
+            else if (data_[pos_] == ')')
+                break;
+            else if (!at_number())
+                fail("number");
+            typename value::rep<Type>::value_type elem;
+            if (!element(read_number(), elem))
+                fail("fixnum");
+            elems.push_back(elem);
+        }
+        ++pos_;
+        return value::make<Type>(std::move(elems));
+    }
+
+    value read_string()
+    {
+        ++pos_;
+        auto const first = offset();
+        for (; !at_end() && data_[pos_] != '"'; ++pos_)
+            if (data_[pos_] == '\n')
+                new_line();
+        if (at_end())
+            fail("'\"'");
+        auto const ret = value::make<string>(text(first).to_string());
+        ++pos_;
+        return ret;
+    }
+
+    value read_quoted()
+    {
+        ++pos_;
+        if (!at_end() && is_space(data_[pos_]))
+            fail("expression");
+        auto const quoted = read_expr();
+        return make_pair(value::make<atom>(symbol("quote")), make_pair(quoted, value()));
+    }
+
+    std::istream *source_;
+    std::string buffer_;
+    char const *data_;
+    std::size_t size_;
+    // Offsets into data_. mark_ is where the datum in progress starts; base_
+    // is how much of the stream has been dropped before data_.
+    std::size_t pos_;
+    std::size_t mark_;
+    std::size_t base_;
+    std::size_t line_;
+    std::size_t line_start_;
+};
 
 template <class C, class CT>
 inline std::basic_istream<C, CT> &operator>>(std::basic_istream<C, CT> &is, value &val)
 {
     using iterator = boost::spirit::basic_istream_iterator<C, CT>;
-    read_detail::value_grammar<iterator> expr;
+    auto &expr = read_detail::grammar<iterator>();
     auto it = iterator(is);
     auto const res = boost::spirit::qi::phrase_parse(
         it,
@@ -130,7 +565,7 @@ inline std::basic_istream<C, CT> &operator>>(std::basic_istream<C, CT> &is, valu
 
 inline value read(std::string const &input)
 {
-    read_detail::value_grammar<std::string::const_iterator> expr;
+    auto &expr = read_detail::grammar<std::string::const_iterator>();
     auto it = input.begin();
     value val;
     auto const res = boost::spirit::qi::phrase_parse(
@@ -146,17 +581,10 @@ inline value read(std::string const &input)
 
 inline std::vector<value> read_expr_list(std::string const &input)
 {
-    read_detail::value_grammar<std::string::const_iterator> expr;
-    auto it = input.begin();
+    reader rdr(input.data(), input.data() + input.size());
     std::vector<value> vals;
-    auto const res = boost::spirit::qi::phrase_parse(
-        it,
-        input.end(),
-        *expr,
-        boost::spirit::ascii::space,
-        vals);
-    if (!res)
-        throw parse_error(expr.get_error());
+    while (auto val = rdr.next())
+        vals.push_back(std::move(*val));
     return vals;
 }
 }
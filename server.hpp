@@ -0,0 +1,231 @@
+#ifndef IOLISP_SERVER_HPP
+#define IOLISP_SERVER_HPP
+
+#include <chrono>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "./errors.hpp"
+#include "./interpreter.hpp"
+#include "./interpreter_pool.hpp"
+#include "./protocol.hpp"
+#include "./show.hpp"
+
+namespace iolisp
+{
+namespace server_detail
+{
+// Sends what is written as frames of one kind, a block at a time and
+// whenever the stream is flushed.
+class frame_buf
+  : public std::streambuf
+{
+public:
+    frame_buf(int fd, protocol::frame_kind kind)
+      : fd_(fd), kind_(kind), buffer_(64 * 1024)
+    {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (!send())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        return send() ? 0 : -1;
+    }
+
+private:
+    bool send()
+    {
+        auto const size = static_cast<std::size_t>(pptr() - pbase());
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+        return size == 0 || protocol::send_frame(fd_, kind_, buffer_.data(), size);
+    }
+
+    int fd_;
+    protocol::frame_kind kind_;
+    std::vector<char> buffer_;
+};
+
+inline std::string describe_errno(std::string const &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+// Whether a call failed for want of descriptors or memory, which may be
+// freed.
+inline bool out_of_resources(int err)
+{
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+}
+
+// Runs the scripts sent by iolisp-client (see protocol.hpp) on an
+// interpreter_pool. A script gets its arguments as args, as it would from
+// iolisp, and writes to the client; it reads nothing. Relative paths in it
+// are relative to the server's directory.
+//
+// Each request is logged to standard error with its latency, from the
+// connection being accepted to the status being sent, and the part of it
+// spent waiting for a free interpreter. A client whose request stalls for
+// request_timeout_seconds while an interpreter reads it is dropped, so idle
+// connections cannot hold interpreters.
+class server
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int request_timeout_seconds = 5;
+
+    // Listens on path, replacing a stale socket there.
+    server(std::string const &path, interpreter_pool &pool)
+      : path_(path), pool_(pool), listener_(-1)
+    {
+        listen();
+    }
+
+    server(server const &) = delete;
+    server &operator=(server const &) = delete;
+
+    ~server()
+    {
+        ::close(listener_);
+        ::unlink(path_.c_str());
+    }
+
+    // Accepts connections until the socket fails. A connection that fails
+    // as it is accepted is skipped, and while descriptors or memory run
+    // out, it waits a little before trying again.
+    void run()
+    {
+        while (true)
+        {
+            auto const fd = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0 && (errno == EINTR || errno == ECONNABORTED || errno == EPROTO))
+                continue;
+            else if (fd < 0 && server_detail::out_of_resources(errno))
+            {
+                log_error(server_detail::describe_errno("accept"));
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            else if (fd < 0)
+                throw error(server_detail::describe_errno("accept"));
+            timeval const timeout{request_timeout_seconds, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            auto const accepted = clock::now();
+            pool_.submit([this, fd, accepted](interpreter &interp, std::ostream &console)
+                {
+                    serve(interp, console, fd, accepted);
+                });
+        }
+    }
+
+private:
+    void listen()
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path))
+            throw error("Socket path too long: " + path_);
+        path_.copy(addr.sun_path, path_.size());
+        struct stat st;
+        if (::stat(path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            ::unlink(path_.c_str());
+        listener_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener_ < 0)
+            throw error(server_detail::describe_errno("socket"));
+        if (::bind(listener_, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listener_, SOMAXCONN) != 0)
+        {
+            auto const message = server_detail::describe_errno(path_);
+            ::close(listener_);
+            throw error(message);
+        }
+    }
+
+    void serve(interpreter &interp, std::ostream &console, int fd, clock::time_point accepted)
+    {
+        auto const started = clock::now();
+        char kind;
+        std::string payload;
+        std::vector<std::string> strs;
+        if (!protocol::receive_frame(fd, kind, payload) || kind != protocol::request ||
+            !protocol::unpack_strings(payload, strs) || strs.empty())
+        {
+            ::close(fd);
+            return;
+        }
+        server_detail::frame_buf out(fd, protocol::output);
+        console.rdbuf(&out);
+        auto status = 0;
+        try
+        {
+            console << interp.run(strs[0], {strs.begin() + 1, strs.end()}) << std::endl;
+        }
+        catch (std::exception const &e)
+        {
+            console.flush();
+            protocol::send_frame(fd, protocol::error_output, e.what() + std::string("\n"));
+            status = 1;
+        }
+        console.flush();
+        console.rdbuf(nullptr);
+        protocol::send_frame(fd, protocol::status, std::to_string(status));
+        ::close(fd);
+        log(strs[0], status, accepted, started);
+    }
+
+    void log(std::string const &script, int status, clock::time_point accepted, clock::time_point started)
+    {
+        using ms = std::chrono::duration<double, std::milli>;
+        auto const now = clock::now();
+        char line[64];
+        std::snprintf(
+            line,
+            sizeof(line),
+            " (status %d) in %.3f ms, %.3f ms queued\n",
+            status,
+            ms(now - accepted).count(),
+            ms(started - accepted).count());
+        std::lock_guard<std::mutex> lock(log_mutex_);
+        std::cerr << script << line << std::flush;
+    }
+
+    void log_error(std::string const &message)
+    {
+        std::lock_guard<std::mutex> lock(log_mutex_);
+        std::cerr << message << std::endl;
+    }
+
+    std::string path_;
+    interpreter_pool &pool_;
+    int listener_;
+    std::mutex log_mutex_;
+};
+}
+
+#endif
@@ -1,46 +1,142 @@
 #ifndef IOLISP_SHOW_HPP
 #define IOLISP_SHOW_HPP
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <ostream>
 #include <string>
+#include <vector>
 #include <boost/lexical_cast.hpp>
 #include <boost/range/adaptor/sliced.hpp>
 #include "./value.hpp"
 
 namespace iolisp
 {
+namespace show_detail
+{
+// The vectors being written, outermost first. Only a vector can make a
+// value contain itself; when one is met inside itself it is written as
+// #(...).
+class vector_path
+{
+public:
+    explicit vector_path(void const *vec)
+      : vec_(vec), cycle_(std::find(path().begin(), path().end(), vec) != path().end())
+    {
+        if (!cycle_)
+            path().push_back(vec_);
+    }
+
+    ~vector_path()
+    {
+        if (!cycle_)
+            path().pop_back();
+    }
+
+    vector_path(vector_path const &) = delete;
+    vector_path &operator=(vector_path const &) = delete;
+
+    bool cycle() const
+    {
+        return cycle_;
+    }
+
+private:
+    static std::vector<void const *> &path()
+    {
+        static thread_local std::vector<void const *> vecs;
+        return vecs;
+    }
+
+    void const *vec_;
+    bool cycle_;
+};
+}
+
+// The shortest form that reads back as the same double. A flonum always
+// has a fraction or exponent, so it cannot be mistaken for an integer.
+inline std::string flonum_to_string(double d)
+{
+    if (std::isnan(d))
+        return "+nan.0";
+    else if (std::isinf(d))
+        return d < 0 ? "-inf.0" : "+inf.0";
+    char buf[32];
+    for (auto precision = 15; precision <= 17; ++precision)
+    {
+        std::snprintf(buf, sizeof(buf), "%.*g", precision, d);
+        if (std::strtod(buf, nullptr) == d)
+            break;
+    }
+    std::string ret(buf);
+    if (ret.find_first_of(".e") == std::string::npos)
+        ret += ".0";
+    return ret;
+}
+
 template <class C, class CT>
 inline std::basic_ostream<C, CT> &operator<<(std::basic_ostream<C, CT> &os, value const &val)
 {
     if (val.is<atom>())
         os << val.get<atom>();
-    else if (val.is<list>())
+    else if (val.is<nil>())
+        os << "()";
+    else if (val.is<pair>())
     {
-        os << '(';
-        auto const &vec = val.get<list>();
-        if (!vec.empty())
-        {
-            os << vec.front();
-            for (auto const &elem : vec | boost::adaptors::sliced(1, vec.size()))
-                os << ' ' << elem;
-        }
+        os << '(' << val.get<pair>().car;
+        auto pos = &val.get<pair>().cdr;
+        for (; pos->is<pair>(); pos = &pos->get<pair>().cdr)
+            os << ' ' << pos->get<pair>().car;
+        if (!pos->is<nil>())
+            os << " . " << *pos;
         os << ')';
     }
-    else if (val.is<dotted_list>())
+    else if (val.is<vector>())
     {
-        os << '(';
-        for (auto const &elem : val.get<dotted_list>().first)
-            os << elem << ' ';
-        os << ". " << val.get<dotted_list>().second << ')';
+        auto const &elems = val.get<vector>();
+        show_detail::vector_path const path(&elems);
+        if (path.cycle())
+            return os << "#(...)";
+        os << "#(";
+        for (std::size_t i = 0; i != elems.size(); ++i)
+            os << (i == 0 ? "" : " ") << elems[i];
+        os << ')';
+    }
+    else if (val.is<f64vector>())
+    {
+        auto const &elems = val.get<f64vector>();
+        os << "#f64(";
+        for (std::size_t i = 0; i != elems.size(); ++i)
+            os << (i == 0 ? "" : " ") << flonum_to_string(elems[i]);
+        os << ')';
+    }
+    else if (val.is<s64vector>())
+    {
+        auto const &elems = val.get<s64vector>();
+        os << "#s64(";
+        for (std::size_t i = 0; i != elems.size(); ++i)
+            os << (i == 0 ? "" : " ") << elems[i];
+        os << ')';
     }
     else if (val.is<number>())
         os << val.get<number>();
-    else if (val.is<string>())
-        os << '"' << val.get<string>() << '"';
+    else if (val.is<bignum>())
+        os << val.get<bignum>();
+    else if (val.is<flonum>())
+        os << flonum_to_string(val.get<flonum>());
+    else if (is_text(val))
+        os << '"' << text_of(val) << '"';
     else if (val.is<bool_>())
         os << (val.get<bool_>() ? "#t" : "#f");
     else if (val.is<port>())
         os << "<IO port>";
+    else if (val.is<hash_table>())
+        os << "<hash table>";
+    else if (val.is<future>())
+        os << "<future>";
     else if (val.is<primitive_function>())
         os << "<primitive>";
     else if (val.is<io_function>())
@@ -0,0 +1,522 @@
+#ifndef IOLISP_SIMD_HPP
+#define IOLISP_SIMD_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define IOLISP_AVX2_KERNELS
+#endif
+#include "./number.hpp"
+
+namespace iolisp
+{
+// The loops behind the f64vector and s64vector primitives. Each kernel has
+// a portable version and, on x86-64, an AVX2 version that is chosen at run
+// time when the processor has AVX2, so the build needs no extra flags.
+// Setting IOLISP_NO_SIMD forces the portable versions.
+//
+// Sums, dot products and prefix sums of doubles are not added strictly from
+// left to right. The portable versions keep the same partial sums, in the
+// same lanes, as the AVX2 ones, so a result never depends on which version
+// ran.
+//
+// Elementwise operations take the same operation structs as arithmetic, and
+// so give the same results as + - * on each pair of elements; an s64 kernel
+// returns false if a result overflowed.
+namespace simd_detail
+{
+#ifdef IOLISP_AVX2_KERNELS
+#define IOLISP_AVX2 __attribute__((target("avx2")))
+
+inline bool use_avx2()
+{
+    static bool const ret = __builtin_cpu_supports("avx2") && !std::getenv("IOLISP_NO_SIMD");
+    return ret;
+}
+
+// The AVX2 form of an operation. An s64 form also collects, in the sign bit
+// of each lane of overflow, whether that lane overflowed.
+template <class Op>
+struct avx2_op;
+
+template <>
+struct avx2_op<number_detail::add>
+{
+    static constexpr bool has_s64 = true;
+
+    IOLISP_AVX2 static __m256d f64(__m256d lhs, __m256d rhs)
+    {
+        return _mm256_add_pd(lhs, rhs);
+    }
+
+    IOLISP_AVX2 static __m256i s64(__m256i lhs, __m256i rhs, __m256i &overflow)
+    {
+        auto const ret = _mm256_add_epi64(lhs, rhs);
+        overflow = _mm256_or_si256(
+            overflow,
+            _mm256_and_si256(_mm256_xor_si256(lhs, ret), _mm256_xor_si256(rhs, ret)));
+        return ret;
+    }
+};
+
+template <>
+struct avx2_op<number_detail::subtract>
+{
+    static constexpr bool has_s64 = true;
+
+    IOLISP_AVX2 static __m256d f64(__m256d lhs, __m256d rhs)
+    {
+        return _mm256_sub_pd(lhs, rhs);
+    }
+
+    IOLISP_AVX2 static __m256i s64(__m256i lhs, __m256i rhs, __m256i &overflow)
+    {
+        auto const ret = _mm256_sub_epi64(lhs, rhs);
+        overflow = _mm256_or_si256(
+            overflow,
+            _mm256_and_si256(_mm256_xor_si256(lhs, rhs), _mm256_xor_si256(lhs, ret)));
+        return ret;
+    }
+};
+
+// AVX2 has no 64-bit multiply, so s64 products stay scalar.
+template <>
+struct avx2_op<number_detail::multiply>
+{
+    static constexpr bool has_s64 = false;
+
+    IOLISP_AVX2 static __m256d f64(__m256d lhs, __m256d rhs)
+    {
+        return _mm256_mul_pd(lhs, rhs);
+    }
+};
+
+IOLISP_AVX2 inline bool any_overflow(__m256i overflow)
+{
+    return _mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0;
+}
+#else
+inline bool use_avx2()
+{
+    return false;
+}
+#endif
+
+// The right operand is rhs[i], or rhs[0] for every i when it is broadcast.
+template <bool Broadcast>
+inline std::size_t rhs_index(std::size_t i)
+{
+    return Broadcast ? 0 : i;
+}
+
+template <class Op, bool Broadcast>
+inline void map_f64_portable(double const *lhs, double const *rhs, double *out, std::size_t n)
+{
+    for (std::size_t i = 0; i != n; ++i)
+        out[i] = Op::flonum(lhs[i], rhs[rhs_index<Broadcast>(i)]);
+}
+
+template <class Op, bool Broadcast>
+inline bool map_s64_portable(std::int64_t const *lhs, std::int64_t const *rhs, std::int64_t *out, std::size_t n)
+{
+    for (std::size_t i = 0; i != n; ++i)
+        if (!Op::fixnum(lhs[i], rhs[rhs_index<Broadcast>(i)], out[i]))
+            return false;
+    return true;
+}
+
+// Eight partial sums, as two four-lane accumulators, which are added lane
+// by lane, then pairwise; the elements past the last eight are added last,
+// in order.
+inline double sum_f64_portable(double const *first, std::size_t n)
+{
+    double acc[8] = {};
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        for (std::size_t k = 0; k != 8; ++k)
+            acc[k] += first[i + k];
+    auto ret = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+    for (; i != n; ++i)
+        ret += first[i];
+    return ret;
+}
+
+inline double dot_f64_portable(double const *lhs, double const *rhs, std::size_t n)
+{
+    double acc[8] = {};
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        for (std::size_t k = 0; k != 8; ++k)
+            acc[k] += lhs[i + k] * rhs[i + k];
+    auto ret = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+    for (; i != n; ++i)
+        ret += lhs[i] * rhs[i];
+    return ret;
+}
+
+// Each block of four is scanned in two steps, adding the element one and
+// then two places before, and the total so far is added to the result.
+inline void prefix_sum_f64_portable(double const *first, double *out, std::size_t n)
+{
+    double carry = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        double const x[4] = {first[i], first[i + 1], first[i + 2], first[i + 3]};
+        double const y[4] = {x[0] + 0.0, x[1] + x[0], x[2] + x[1], x[3] + x[2]};
+        double const z[4] = {y[0] + 0.0, y[1] + 0.0, y[2] + y[0], y[3] + y[1]};
+        for (std::size_t k = 0; k != 4; ++k)
+            out[i + k] = z[k] + carry;
+        carry = out[i + 3];
+    }
+    for (; i != n; ++i)
+        out[i] = carry = carry + first[i];
+}
+
+// Returns NaN if any element is NaN. n must not be 0.
+template <bool Min>
+inline double extremum_f64_portable(double const *first, std::size_t n)
+{
+    auto ret = Min ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
+    auto nan = false;
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        if (std::isnan(first[i]))
+            nan = true;
+        else if (Min ? first[i] < ret : first[i] > ret)
+            ret = first[i];
+    }
+    return nan ? std::numeric_limits<double>::quiet_NaN() : ret;
+}
+
+inline bool sum_s64_portable(std::int64_t const *first, std::size_t n, std::int64_t &ret)
+{
+    ret = 0;
+    for (std::size_t i = 0; i != n; ++i)
+        if (__builtin_add_overflow(ret, first[i], &ret))
+            return false;
+    return true;
+}
+
+inline bool dot_s64_portable(std::int64_t const *lhs, std::int64_t const *rhs, std::size_t n, std::int64_t &ret)
+{
+    ret = 0;
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        std::int64_t product;
+        if (__builtin_mul_overflow(lhs[i], rhs[i], &product) || __builtin_add_overflow(ret, product, &ret))
+            return false;
+    }
+    return true;
+}
+
+inline bool prefix_sum_s64_portable(std::int64_t const *first, std::int64_t *out, std::size_t n)
+{
+    std::int64_t total = 0;
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        if (__builtin_add_overflow(total, first[i], &total))
+            return false;
+        out[i] = total;
+    }
+    return true;
+}
+
+template <bool Min>
+inline std::int64_t extremum_s64_portable(std::int64_t const *first, std::size_t n)
+{
+    auto ret = Min ? std::numeric_limits<std::int64_t>::max() : std::numeric_limits<std::int64_t>::min();
+    for (std::size_t i = 0; i != n; ++i)
+        if (Min ? first[i] < ret : first[i] > ret)
+            ret = first[i];
+    return ret;
+}
+
+#ifdef IOLISP_AVX2_KERNELS
+template <bool Broadcast>
+IOLISP_AVX2 inline __m256d load_rhs(double const *rhs, std::size_t i)
+{
+    return Broadcast ? _mm256_set1_pd(rhs[0]) : _mm256_loadu_pd(rhs + i);
+}
+
+template <bool Broadcast>
+IOLISP_AVX2 inline __m256i load_rhs(std::int64_t const *rhs, std::size_t i)
+{
+    return Broadcast ?
+        _mm256_set1_epi64x(rhs[0]) :
+        _mm256_loadu_si256(reinterpret_cast<__m256i const *>(rhs + i));
+}
+
+template <class Op, bool Broadcast>
+IOLISP_AVX2 inline void map_f64_avx2(double const *lhs, double const *rhs, double *out, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, avx2_op<Op>::f64(_mm256_loadu_pd(lhs + i), load_rhs<Broadcast>(rhs, i)));
+    for (; i != n; ++i)
+        out[i] = Op::flonum(lhs[i], rhs[rhs_index<Broadcast>(i)]);
+}
+
+template <class Op, bool Broadcast>
+IOLISP_AVX2 inline bool map_s64_avx2(
+    std::int64_t const *lhs,
+    std::int64_t const *rhs,
+    std::int64_t *out,
+    std::size_t n,
+    std::true_type)
+{
+    auto overflow = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(out + i),
+            avx2_op<Op>::s64(
+                _mm256_loadu_si256(reinterpret_cast<__m256i const *>(lhs + i)),
+                load_rhs<Broadcast>(rhs, i),
+                overflow));
+    if (any_overflow(overflow))
+        return false;
+    return map_s64_portable<Op, Broadcast>(lhs + i, rhs + rhs_index<Broadcast>(i), out + i, n - i);
+}
+
+template <class Op, bool Broadcast>
+inline bool map_s64_avx2(
+    std::int64_t const *lhs,
+    std::int64_t const *rhs,
+    std::int64_t *out,
+    std::size_t n,
+    std::false_type)
+{
+    return map_s64_portable<Op, Broadcast>(lhs, rhs, out, n);
+}
+
+IOLISP_AVX2 inline double sum_lanes(__m256d acc0, __m256d acc1)
+{
+    double acc[4];
+    _mm256_storeu_pd(acc, _mm256_add_pd(acc0, acc1));
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+IOLISP_AVX2 inline double sum_f64_avx2(double const *first, std::size_t n)
+{
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(first + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(first + i + 4));
+    }
+    auto ret = sum_lanes(acc0, acc1);
+    for (; i != n; ++i)
+        ret += first[i];
+    return ret;
+}
+
+IOLISP_AVX2 inline double dot_f64_avx2(double const *lhs, double const *rhs, std::size_t n)
+{
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(lhs + i + 4), _mm256_loadu_pd(rhs + i + 4)));
+    }
+    auto ret = sum_lanes(acc0, acc1);
+    for (; i != n; ++i)
+        ret += lhs[i] * rhs[i];
+    return ret;
+}
+
+IOLISP_AVX2 inline void prefix_sum_f64_avx2(double const *first, double *out, std::size_t n)
+{
+    auto const zero = _mm256_setzero_pd();
+    auto carry = zero;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        auto x = _mm256_loadu_pd(first + i);
+        // [0, x0, x1, x2], then [0, 0, y0, y1].
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x90), zero, 0x1));
+        x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x40), zero, 0x3));
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(out + i, x);
+        carry = _mm256_permute4x64_pd(x, 0xff);
+    }
+    auto total = _mm256_cvtsd_f64(carry);
+    for (; i != n; ++i)
+        out[i] = total = total + first[i];
+}
+
+template <bool Min>
+IOLISP_AVX2 inline double extremum_f64_avx2(double const *first, std::size_t n)
+{
+    auto acc = _mm256_set1_pd(Min ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity());
+    auto nan = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        auto const x = _mm256_loadu_pd(first + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        // The second operand is kept when either is NaN.
+        acc = Min ? _mm256_min_pd(x, acc) : _mm256_max_pd(x, acc);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    auto ret = extremum_f64_portable<Min>(lanes, 4);
+    if (_mm256_movemask_pd(nan) != 0)
+        return std::numeric_limits<double>::quiet_NaN();
+    else if (i == n)
+        return ret;
+    auto const rest = extremum_f64_portable<Min>(first + i, n - i);
+    return std::isnan(rest) || (Min ? rest < ret : rest > ret) ? rest : ret;
+}
+
+IOLISP_AVX2 inline bool sum_s64_avx2(std::int64_t const *first, std::size_t n, std::int64_t &ret)
+{
+    auto acc = _mm256_setzero_si256();
+    auto overflow = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        acc = avx2_op<number_detail::add>::s64(
+            acc,
+            _mm256_loadu_si256(reinterpret_cast<__m256i const *>(first + i)),
+            overflow);
+    if (any_overflow(overflow))
+        return false;
+    std::int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    std::int64_t rest;
+    if (!sum_s64_portable(lanes, 4, ret) || !sum_s64_portable(first + i, n - i, rest))
+        return false;
+    return !__builtin_add_overflow(ret, rest, &ret);
+}
+
+template <bool Min>
+IOLISP_AVX2 inline std::int64_t extremum_s64_avx2(std::int64_t const *first, std::size_t n)
+{
+    auto acc = _mm256_set1_epi64x(Min ? std::numeric_limits<std::int64_t>::max() : std::numeric_limits<std::int64_t>::min());
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        auto const x = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(first + i));
+        auto const take = Min ? _mm256_cmpgt_epi64(acc, x) : _mm256_cmpgt_epi64(x, acc);
+        acc = _mm256_blendv_epi8(acc, x, take);
+    }
+    std::int64_t lanes[5];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    lanes[4] = extremum_s64_portable<Min>(first + i, n - i);
+    return extremum_s64_portable<Min>(lanes, 5);
+}
+#endif
+}
+
+// out[i] = Op(lhs[i], rhs[i]), or Op(lhs[i], rhs[0]) when Broadcast.
+template <class Op, bool Broadcast>
+inline void map_f64(double const *lhs, double const *rhs, double *out, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return map_f64_avx2<Op, Broadcast>(lhs, rhs, out, n);
+#endif
+    map_f64_portable<Op, Broadcast>(lhs, rhs, out, n);
+}
+
+template <class Op, bool Broadcast>
+inline bool map_s64(std::int64_t const *lhs, std::int64_t const *rhs, std::int64_t *out, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return map_s64_avx2<Op, Broadcast>(
+            lhs, rhs, out, n,
+            std::integral_constant<bool, avx2_op<Op>::has_s64>());
+#endif
+    return map_s64_portable<Op, Broadcast>(lhs, rhs, out, n);
+}
+
+inline double sum_f64(double const *first, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return sum_f64_avx2(first, n);
+#endif
+    return sum_f64_portable(first, n);
+}
+
+inline double dot_f64(double const *lhs, double const *rhs, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return dot_f64_avx2(lhs, rhs, n);
+#endif
+    return dot_f64_portable(lhs, rhs, n);
+}
+
+inline void prefix_sum_f64(double const *first, double *out, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return prefix_sum_f64_avx2(first, out, n);
+#endif
+    prefix_sum_f64_portable(first, out, n);
+}
+
+template <bool Min>
+inline double extremum_f64(double const *first, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return extremum_f64_avx2<Min>(first, n);
+#endif
+    return extremum_f64_portable<Min>(first, n);
+}
+
+// Returns false if the sum, or a partial sum, overflowed.
+inline bool sum_s64(std::int64_t const *first, std::size_t n, std::int64_t &ret)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return sum_s64_avx2(first, n, ret);
+#endif
+    return sum_s64_portable(first, n, ret);
+}
+
+// Products need a 64-bit multiply, which AVX2 lacks, and a prefix sum of
+// integers gains little from a four-lane scan, so these two have only the
+// portable version.
+inline bool dot_s64(std::int64_t const *lhs, std::int64_t const *rhs, std::size_t n, std::int64_t &ret)
+{
+    return simd_detail::dot_s64_portable(lhs, rhs, n, ret);
+}
+
+inline bool prefix_sum_s64(std::int64_t const *first, std::int64_t *out, std::size_t n)
+{
+    return simd_detail::prefix_sum_s64_portable(first, out, n);
+}
+
+template <bool Min>
+inline std::int64_t extremum_s64(std::int64_t const *first, std::size_t n)
+{
+    using namespace simd_detail;
+#ifdef IOLISP_AVX2_KERNELS
+    if (use_avx2())
+        return extremum_s64_avx2<Min>(first, n);
+#endif
+    return extremum_s64_portable<Min>(first, n);
+}
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef IOLISP_SYMBOL_HPP
+#define IOLISP_SYMBOL_HPP
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/utility/string_view.hpp>
+
+namespace iolisp
+{
+namespace symbol_detail
+{
+struct name_hash
+{
+    std::size_t operator()(boost::string_view name) const
+    {
+        return boost::hash_range(name.begin(), name.end());
+    }
+};
+
+struct name_equal
+{
+    bool operator()(boost::string_view lhs, boost::string_view rhs) const
+    {
+        return lhs == rhs;
+    }
+};
+}
+
+// An interned name. Every symbol with the same spelling refers to the same
+// table entry, so symbols compare and hash as pointers.
+class symbol
+{
+public:
+    explicit symbol(boost::string_view name)
+      : name_(&intern(name))
+    {}
+
+    std::string const &name() const
+    {
+        return *name_;
+    }
+
+    friend bool operator==(symbol const &lhs, symbol const &rhs)
+    {
+        return lhs.name_ == rhs.name_;
+    }
+
+    friend bool operator!=(symbol const &lhs, symbol const &rhs)
+    {
+        return lhs.name_ != rhs.name_;
+    }
+
+    friend bool operator<(symbol const &lhs, symbol const &rhs)
+    {
+        return std::less<std::string const *>()(lhs.name_, rhs.name_);
+    }
+
+    std::size_t hash() const
+    {
+        return std::hash<std::string const *>()(name_);
+    }
+
+private:
+    // Entries are never removed, and the set is node based, so a reference
+    // to a name stays valid for the life of the process. Each thread caches
+    // the names it has seen, so repeated names skip the lock.
+    static std::string const &intern(boost::string_view name)
+    {
+        static thread_local boost::unordered_map<
+            boost::string_view,
+            std::string const *,
+            symbol_detail::name_hash,
+            symbol_detail::name_equal> cache;
+        auto const cached = cache.find(name);
+        if (cached != cache.end())
+            return *cached->second;
+        auto const &interned = intern_shared(name);
+        cache.emplace(interned, &interned);
+        return interned;
+    }
+
+    static std::string const &intern_shared(boost::string_view name)
+    {
+        static std::mutex mutex;
+        static boost::unordered_set<
+            std::string,
+            symbol_detail::name_hash,
+            symbol_detail::name_equal> table;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto const it = table.find(name, symbol_detail::name_hash(), symbol_detail::name_equal());
+        if (it != table.end())
+            return *it;
+        return *table.emplace(name.begin(), name.end()).first;
+    }
+
+    std::string const *name_;
+};
+
+template <class C, class CT>
+inline std::basic_ostream<C, CT> &operator<<(std::basic_ostream<C, CT> &os, symbol const &sym)
+{
+    return os << sym.name();
+}
+}
+
+namespace std
+{
+template <>
+struct hash<iolisp::symbol>
+{
+    std::size_t operator()(iolisp::symbol const &sym) const
+    {
+        return sym.hash();
+    }
+};
+}
+
+#endif
@@ -0,0 +1,30 @@
+(define a (vector 1))
+(vector-set! a 0 a)
+
+(define b (vector 1))
+(vector-set! b 0 b)
+
+(define c (vector 1 2))
+(vector-set! c 0 c)
+
+(define d (vector 1 3))
+(vector-set! d 0 d)
+
+(define e (vector 1 2))
+(vector-set! e 0 (vector e 2))
+
+(if (equal? a b) #t cyclic-equal-failed)
+
+(if (eqv? a b) #t cyclic-eqv-failed)
+
+(if (equal? c d) cyclic-unequal-failed #t)
+
+(if (equal? c e) #t cyclic-unrolled-failed)
+
+(define table (make-hash-table))
+
+(hash-table-set! table a 'found)
+
+(if (eq? (hash-table-ref table b) 'found) #t cyclic-hash-table-failed)
+
+(if (hash-table-contains? table c) cyclic-hash-table-unequal-failed #t)
@@ -0,0 +1,8 @@
+(define (loop n)
+  (if (= n 0)
+      #t
+      (if (= (vector-length (touch (future (lambda () (make-vector 1000 0))))) 1000)
+          (loop (- n 1))
+          future-loop-failed)))
+
+(loop 20000)
@@ -0,0 +1,5 @@
+#!/bin/sh
+# limit_memory.sh KB command [args...]
+#
+# Runs command with its address space limited to KB kilobytes.
+ulimit -v "$1" && shift && exec "$@"
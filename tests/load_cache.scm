@@ -0,0 +1,3 @@
+(if (string=? which (car args))
+    #t
+    load-cache-failed)
@@ -0,0 +1,42 @@
+#!/bin/sh
+# load_cache.sh iolisp check.scm
+#
+# Preloads libraries through the load cache, in a directory of its own,
+# and runs check.scm to see that each defines what its source says now.
+set -e
+iolisp=$1
+check=$2
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export IOLISP_CACHE_DIR="$dir/cache"
+mkdir "$dir/cache" "$dir/a" "$dir/b"
+a=$dir/a/lib.scm
+b=$dir/b/lib.scm
+
+# The second load uses the cache the first wrote, without replacing it.
+echo '(define which "aaa")' > "$a"
+"$iolisp" --preload "$a" "$check" aaa
+cache=$(ls -i "$dir/cache")
+test -n "$cache"
+"$iolisp" --preload "$a" "$check" aaa
+test "$(ls -i "$dir/cache")" = "$cache"
+
+# An edit that keeps the size and mtime.
+touch -r "$a" "$dir/stamp"
+echo '(define which "bbb")' > "$a"
+touch -r "$dir/stamp" "$a"
+"$iolisp" --preload "$a" "$check" bbb
+
+# Another path with the same size and mtime.
+echo '(define which "ccc")' > "$b"
+touch -r "$a" "$b"
+"$iolisp" --preload "$b" "$check" ccc
+"$iolisp" --preload "$a" "$check" bbb
+
+# A cache damaged inside its forms, which falls back to the source.
+for file in "$dir"/cache/*; do
+    size=$(wc -c < "$file")
+    printf '\012' | dd of="$file" bs=1 seek=$((size - 1)) conv=notrunc 2> /dev/null
+done
+"$iolisp" --preload "$a" "$check" bbb
+"$iolisp" --preload "$b" "$check" ccc
@@ -0,0 +1,25 @@
+(if (= (quotient 7.5 2) 3.0) #t quotient-flonum-failed)
+
+(if (= (quotient (- 0 7.5) 2) (- 0 3.0)) #t quotient-negative-flonum-failed)
+
+(if (= (quotient 7 2) 3) #t quotient-fixnum-failed)
+
+(if (= (/ 7.5 2) 3.75) #t divide-flonum-failed)
+
+(if (= (/ 7 2) 3) #t divide-fixnum-failed)
+
+(if (= (remainder 7.5 2) 1.5) #t remainder-flonum-failed)
+
+(if (= 9007199254740993 9007199254740992.0) compare-rounded-fixnum-failed #t)
+
+(if (< 9007199254740992.0 9007199254740993) #t compare-flonum-fixnum-failed)
+
+(if (= 9007199254740992 9007199254740992.0) #t compare-exact-fixnum-failed)
+
+(if (< 100000000000000000000000000000 1e30) #t compare-bignum-failed)
+
+(if (< 9223372036854775807 9223372036854775808.0) #t compare-fixnum-limit-failed)
+
+(if (< (- 0 3) (- 0 2.5)) #t compare-fraction-failed)
+
+(if (equal? 9007199254740993 9007199254740992.0) equal-rounded-fixnum-failed #t)
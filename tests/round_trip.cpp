@@ -0,0 +1,304 @@
+#define BOOST_RESULT_OF_USE_DECLTYPE
+#define BOOST_SPIRIT_USE_PHOENIX_V3
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../binary.hpp"
+#include "../read.hpp"
+#include "../show.hpp"
+
+using namespace iolisp;
+
+namespace
+{
+// Random values of every type the encodings cover. With text set, only
+// what show writes in a form the readers accept: no hash tables, no quote
+// marks in strings and no shared structure.
+class generator
+{
+public:
+    generator(std::uint64_t seed, bool text)
+      : rng_(seed), text_(text)
+    {}
+
+    value operator()()
+    {
+        seen_.clear();
+        return make(0);
+    }
+
+private:
+    value make(int depth)
+    {
+        switch (rng_() % (depth > 6 ? 8 : 12))
+        {
+        case 0:
+            return value();
+        case 1:
+            return value::make<bool_>(rng_() % 2 == 0);
+        case 2:
+            return value::make<number>(fixnum());
+        case 3:
+            return make_integer(big());
+        case 4:
+            return value::make<iolisp::flonum>(real());
+        case 5:
+            return value::make<atom>(symbol(name()));
+        case 6:
+            return value::make<string>(chars());
+        case 7:
+            return numeric_vector();
+        case 8:
+        case 9:
+            return remember(make_list(elements(depth)));
+        case 10:
+            return remember(value::make<vector>(elements(depth)));
+        default:
+            if (!text_ && !seen_.empty() && rng_() % 2 == 0)
+                return seen_[rng_() % seen_.size()];
+            else if (!text_)
+                return remember(table(depth));
+            return make_pair(make(depth + 1), make(depth + 1));
+        }
+    }
+
+    value remember(value const &val)
+    {
+        seen_.push_back(val);
+        return val;
+    }
+
+    std::vector<value> elements(int depth)
+    {
+        std::vector<value> ret(rng_() % 6);
+        for (auto &elem : ret)
+            elem = make(depth + 1);
+        return ret;
+    }
+
+    value table(int depth)
+    {
+        auto ret = value::make<hash_table>(hash_table_rep(static_cast<equivalence>(rng_() % 3)));
+        for (auto n = rng_() % 5; n != 0; --n)
+            ret.get<hash_table>().set(make(depth + 1), make(depth + 1));
+        return ret;
+    }
+
+    value numeric_vector()
+    {
+        auto const size = rng_() % 9;
+        if (rng_() % 2 == 0)
+        {
+            std::vector<double> elems(size);
+            for (auto &elem : elems)
+                elem = real();
+            return value::make<f64vector>(std::move(elems));
+        }
+        std::vector<std::int64_t> elems(size);
+        for (auto &elem : elems)
+            elem = fixnum();
+        return value::make<s64vector>(std::move(elems));
+    }
+
+    bool negative()
+    {
+        return rng_() % 2 == 0;
+    }
+
+    std::int64_t fixnum()
+    {
+        auto const ret = rng_() % 3 == 0
+            ? static_cast<std::int64_t>(rng_() % 150)
+            : static_cast<std::int64_t>(rng_() >> 1);
+        return negative() ? -ret : ret;
+    }
+
+    bigint big()
+    {
+        bigint ret = 1;
+        for (auto n = 1 + rng_() % 6; n != 0; --n)
+            ret *= bigint(rng_()) + 1;
+        return negative() ? bigint(-ret) : ret;
+    }
+
+    // Any bits, so NaNs, infinities and subnormals turn up.
+    double real()
+    {
+        double ret;
+        auto const bits = rng_();
+        std::memcpy(&ret, &bits, sizeof(ret));
+        return ret;
+    }
+
+    std::string name()
+    {
+        std::string ret(1 + rng_() % 8, 'a');
+        for (auto &c : ret)
+            c = static_cast<char>('a' + rng_() % 26);
+        return ret;
+    }
+
+    std::string chars()
+    {
+        std::string ret(rng_() % 20, ' ');
+        for (auto &c : ret)
+            do
+                c = static_cast<char>(text_ ? ' ' + rng_() % 95 : rng_() % 256);
+            while (text_ && c == '"');
+        return ret;
+    }
+
+    std::mt19937_64 rng_;
+    bool text_;
+    std::vector<value> seen_;
+};
+
+int failures = 0;
+
+void expect(bool ok, char const *what, value const &val, std::string const &got)
+{
+    if (ok)
+        return;
+    if (++failures <= 10)
+        std::cerr << what << " changed " << val << "\n    into " << got << std::endl;
+}
+
+// show, read and show again must give the same text, with either reader.
+void text_round_trip(value const &val)
+{
+    auto const text = show(val);
+    try
+    {
+        auto const spirit = show(read(text));
+        expect(spirit == text, "read", val, spirit);
+    }
+    catch (error const &e)
+    {
+        expect(false, "read", val, e.what());
+    }
+    try
+    {
+        auto const vals = read_expr_list(text);
+        auto const hand_written = vals.size() == 1 ? show(vals.front()) : std::string("several values");
+        expect(hand_written == text, "read_expr_list", val, hand_written);
+    }
+    catch (error const &e)
+    {
+        expect(false, "read_expr_list", val, e.what());
+    }
+}
+
+// A record must decode to a value that shows the same, and damaging it
+// must give a value or corrupt_data, never a crash.
+void binary_round_trip(value const &val, std::mt19937_64 &rng)
+{
+    std::ostringstream out;
+    write_binary(out, val);
+    std::istringstream in(out.str());
+    auto const back = read_binary(in);
+    auto const got = back ? show(*back) : std::string("nothing");
+    expect(got == show(val) && !read_binary(in), "write-binary", val, got);
+
+    auto const bytes = out.str();
+    for (auto i = 0; i != 5; ++i)
+    {
+        auto damaged = bytes;
+        switch (rng() % 3)
+        {
+        case 0:
+            damaged[rng() % damaged.size()] = static_cast<char>(rng());
+            break;
+        case 1:
+            damaged.resize(rng() % damaged.size());
+            break;
+        default:
+            damaged.insert(damaged.begin() + rng() % damaged.size(), static_cast<char>(rng()));
+        }
+        std::istringstream damaged_in(damaged);
+        try
+        {
+            while (read_binary(damaged_in))
+                ;
+        }
+        catch (corrupt_data const &)
+        {}
+    }
+}
+
+// Payloads that damage by chance would not find.
+void expect_rejected(std::string const &payload, char const *what)
+{
+    std::ostringstream out;
+    binary_detail::write_record(out, payload);
+    std::istringstream in(out.str());
+    try
+    {
+        // Not shown, since it may contain itself.
+        expect(false, what, value(), read_binary(in) ? "a value" : "nothing");
+    }
+    catch (corrupt_data const &)
+    {}
+}
+
+std::string nested_vectors(std::size_t depth)
+{
+    std::string ret;
+    for (std::size_t i = 0; i != depth; ++i)
+        ret += {static_cast<char>(binary_detail::tag::vector), 1};
+    ret.push_back(static_cast<char>(binary_detail::tag::nil));
+    return ret;
+}
+}
+
+// round_trip [iterations]
+//
+// Writes random values with show and write-binary and reads them back,
+// checking that show gives the same text for what comes back.
+int main(int argc, char *argv[])
+{
+    auto const iterations = argc > 1 ? std::atoi(argv[1]) : 20000;
+    generator text_values(1, true), binary_values(2, false);
+    std::mt19937_64 rng(3);
+    for (auto i = 0; i != iterations; ++i)
+    {
+        text_round_trip(text_values());
+        binary_round_trip(binary_values(), rng);
+    }
+
+    // A pair referenced twice decodes as one object.
+    auto const shared = make_pair(value::make<number>(1), value());
+    std::ostringstream out;
+    write_binary(out, make_list({shared, shared}));
+    std::istringstream in(out.str());
+    auto const back = *read_binary(in);
+    auto const &cell = back.get<pair>();
+    expect(
+        &cell.car.get<pair>() == &cell.cdr.get<pair>().car.get<pair>(),
+        "write-binary sharing",
+        back,
+        "two objects");
+
+    using binary_detail::tag;
+    // A pair that contains itself.
+    expect_rejected(
+        {static_cast<char>(tag::shared),
+         static_cast<char>(tag::list), 1,
+         static_cast<char>(tag::fixnum), 2,
+         static_cast<char>(tag::backref), 0},
+        "a backref into an unfinished pair");
+    expect_rejected(nested_vectors(1000000), "deep nesting");
+    std::ostringstream nested;
+    binary_detail::write_record(nested, nested_vectors(500));
+    std::istringstream nested_in(nested.str());
+    expect(static_cast<bool>(read_binary(nested_in)), "nesting 500 deep", value(), "an error");
+
+    if (failures != 0)
+        std::cerr << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+(define (loop n acc)
+  (if (= n 0)
+      acc
+      (loop (- n 1) (+ acc 1))))
+
+(if (= (loop 10000000 0) 10000000)
+    #t
+    tail-loop-failed)
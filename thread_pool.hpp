@@ -0,0 +1,345 @@
+#ifndef IOLISP_THREAD_POOL_HPP
+#define IOLISP_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "./heap.hpp"
+#include "./port.hpp"
+
+namespace iolisp
+{
+// A piece of work for the thread pool. It runs once, on whichever thread
+// claims it first: a worker, or a thread waiting for it, with the console
+// of the thread that created it. If the job using that console ends first,
+// it is dropped instead (see console::end_tasks).
+class task
+{
+public:
+    task()
+      : state_(queued), console_(console::current())
+    {}
+
+    task(task const &) = delete;
+    task &operator=(task const &) = delete;
+
+    virtual ~task() {}
+
+    bool done() const
+    {
+        return state_.load(std::memory_order_acquire) == finished;
+    }
+
+    // Runs the task here unless another thread has claimed it.
+    bool try_run()
+    {
+        if (!claim())
+            return false;
+        {
+            console::scope const scope(console_);
+            execute();
+        }
+        finish();
+        return true;
+    }
+
+    // Finishes the task without running it unless another thread has
+    // claimed it.
+    bool try_drop()
+    {
+        if (!claim())
+            return false;
+        drop();
+        finish();
+        return true;
+    }
+
+    void wait_done()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.wait(lock, [this] { return done(); });
+    }
+
+protected:
+    // Keeps whatever it throws for whoever waits.
+    virtual void execute() = 0;
+
+    // Releases what execute would have used, leaving an error for whoever
+    // waits.
+    virtual void drop() = 0;
+
+private:
+    enum state
+    {
+        queued,
+        running,
+        finished
+    };
+
+    bool claim()
+    {
+        auto expected = queued;
+        return state_.compare_exchange_strong(expected, running, std::memory_order_acq_rel);
+    }
+
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state_.store(finished, std::memory_order_release);
+        }
+        finished_.notify_all();
+    }
+
+    std::atomic<state> state_;
+    console &console_;
+    std::mutex mutex_;
+    std::condition_variable finished_;
+};
+
+namespace thread_pool_detail
+{
+struct work_queue
+{
+    std::mutex mutex;
+    std::deque<std::shared_ptr<task>> tasks;
+};
+}
+
+// Runs tasks on one thread per core, counting the thread that waits for
+// them, since it runs tasks too; IOLISP_THREADS overrides the count. Each
+// worker queues the tasks it submits on its own deque and takes the newest
+// first. An idle worker steals the oldest task of another, so a task that
+// submits many spreads them over the pool. Tasks submitted from outside the
+// pool go to a shared queue.
+//
+// Each worker allocates from a heap of its own. Nothing is shared with the
+// workers until the pool starts (see heap::share), and with one thread there
+// are no workers, so tasks are not queued at all and run when they are
+// waited for.
+class thread_pool
+{
+public:
+    static thread_pool &get()
+    {
+        static thread_pool pool(thread_count());
+        return pool;
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool &operator=(thread_pool const &) = delete;
+
+    // Waits for the running tasks. Queued ones are dropped.
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        heap::blocking_section const blocking;
+        for (auto &w : workers_)
+            w->thread.join();
+    }
+
+    // The threads that run tasks, including the one waiting for them.
+    std::size_t size() const
+    {
+        return workers_.size() + 1;
+    }
+
+    void submit(std::shared_ptr<task> t)
+    {
+        console::current().started(t);
+        if (workers_.empty())
+            return;
+        heap::current().publish();
+        auto &queue = self() < workers_.size() ? workers_[self()]->queue : shared_;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(t));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            ++pending_;
+        }
+        wake_.notify_one();
+    }
+
+    // Returns once t is done. t runs here unless a worker has claimed it,
+    // and while a worker runs it this thread runs other tasks.
+    void wait(task &t)
+    {
+        if (run(t))
+            return;
+        while (!t.done())
+            if (auto const next = take())
+                run(*next);
+            else
+            {
+                heap::blocking_section const blocking;
+                t.wait_done();
+            }
+    }
+
+private:
+    struct worker
+    {
+        iolisp::heap heap;
+        thread_pool_detail::work_queue queue;
+        std::thread thread;
+    };
+
+    static std::size_t thread_count()
+    {
+        if (auto const env = std::getenv("IOLISP_THREADS"))
+        {
+            auto const n = std::atoi(env);
+            if (n > 0)
+                return static_cast<std::size_t>(n);
+        }
+        auto const n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // The worker index of this thread, or -1 outside the pool.
+    static std::size_t &self()
+    {
+        static thread_local std::size_t index = static_cast<std::size_t>(-1);
+        return index;
+    }
+
+    explicit thread_pool(std::size_t threads)
+      : pending_(0), stopping_(false)
+    {
+        if (threads <= 1)
+            return;
+        heap::share();
+        for (std::size_t i = 0; i + 1 != threads; ++i)
+            workers_.emplace_back(new worker);
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            workers_[i]->thread = std::thread([this, i] { work(i); });
+    }
+
+    // What a task leaves behind is for other threads, so none of it stays
+    // private.
+    static bool run(task &t)
+    {
+        auto const ret = t.try_run();
+        if (ret)
+            heap::current().publish();
+        return ret;
+    }
+
+    // The newest task of this thread's own queue, or else the oldest of
+    // the shared queue or another worker's.
+    std::shared_ptr<task> take()
+    {
+        std::shared_ptr<task> ret;
+        if (self() < workers_.size() && pop(workers_[self()]->queue, false, ret))
+            return ret;
+        if (pop(shared_, true, ret))
+            return ret;
+        auto const start = self() < workers_.size() ? self() + 1 : 0;
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            if (pop(workers_[(start + i) % workers_.size()]->queue, true, ret))
+                return ret;
+        return ret;
+    }
+
+    bool pop(thread_pool_detail::work_queue &queue, bool oldest, std::shared_ptr<task> &ret)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        if (oldest)
+        {
+            ret = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            ret = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        --pending_;
+        return true;
+    }
+
+    void work(std::size_t index)
+    {
+        heap::current_pointer() = &workers_[index]->heap;
+        self() = index;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                wake_.wait(lock, [this] { return stopping_ || pending_ != 0; });
+                if (stopping_)
+                    return;
+            }
+            // Dropping a task releases the values it holds, so that is done
+            // while running too.
+            heap::running_section const running;
+            if (auto const next = take())
+                run(*next);
+        }
+    }
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    thread_pool_detail::work_queue shared_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<std::size_t> pending_;
+    bool stopping_;
+};
+
+// Finished tasks are forgotten whenever the list has doubled, so it stays
+// in proportion to the tasks still alive.
+inline void console::started(std::shared_ptr<task> const &t)
+{
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    if (tasks_.size() >= 2 * kept_tasks_)
+    {
+        tasks_.erase(
+            std::remove_if(tasks_.begin(), tasks_.end(), [](std::weak_ptr<task> const &weak)
+                {
+                    auto const t = weak.lock();
+                    return !t || t->done();
+                }),
+            tasks_.end());
+        kept_tasks_ = std::max<std::size_t>(tasks_.size(), 16);
+    }
+    tasks_.push_back(t);
+}
+
+// A task still running may start others with this console, so the list is
+// taken again until it stays empty.
+inline void console::end_tasks()
+{
+    while (true)
+    {
+        std::vector<std::weak_ptr<task>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            tasks.swap(tasks_);
+            kept_tasks_ = 0;
+        }
+        if (tasks.empty())
+            return;
+        for (auto const &weak : tasks)
+            if (auto const t = weak.lock())
+                if (!t->try_drop())
+                    thread_pool::get().wait(*t);
+    }
+}
+}
+
+#endif
@@ -2,124 +2,651 @@
 #define IOLISP_VALUE_HPP
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <map>
 #include <memory>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <boost/assert.hpp>
-#include <boost/fusion/include/pair.hpp>
-#include <boost/iterator.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/iterator/iterator_facade.hpp>
 #include <boost/mpl/at.hpp>
+#include <boost/mpl/find.hpp>
 #include <boost/mpl/map.hpp>
 #include <boost/mpl/pair.hpp>
+#include <boost/mpl/vector.hpp>
+#include <boost/multiprecision/cpp_int.hpp>
 #include <boost/optional.hpp>
-#include <boost/range/any_range.hpp>
-#include <boost/variant.hpp>
+#include <boost/range/functions.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/utility/string_view.hpp>
+#include "./heap.hpp"
+#include "./symbol.hpp"
 
 namespace iolisp
 {
 struct atom {};
-struct list {};
-struct dotted_list {};
+struct nil {};
+struct pair {};
 struct number {};
+struct flonum {};
+struct bignum {};
 struct string {};
+struct string_slice {};
 struct bool_ {};
 struct port {};
 struct primitive_function {};
 struct io_function {};
 struct function {};
+struct vector {};
+struct f64vector {};
+struct s64vector {};
+struct hash_table {};
+struct future {};
 
 class value;
 
-using arguments = boost::any_range<
-    value,
-    boost::random_access_traversal_tag,
-    value,
-    std::ptrdiff_t>;
+struct cons_cell;
 
-using environment = std::shared_ptr<std::map<
-    std::string,
-    std::shared_ptr<value>>>;
+class frame;
 
+class file_port;
+
+class hash_table_rep;
+
+class future_rep;
+
+namespace eval_detail
+{
+struct lambda_syntax;
+}
+
+// Arguments are passed as a contiguous span; callers keep the values alive
+// for the duration of the call.
+using arguments = boost::iterator_range<value const *>;
+
+using environment = boost::intrusive_ptr<frame>;
+
+namespace value_detail
+{
+template <class Rep>
+inline void trace_children(Rep const &, heap_visitor &)
+{}
+
+template <class Rep>
+inline void clear_children(Rep &)
+{}
+
+template <class Rep>
+inline std::size_t extra_bytes(Rep const &)
+{
+    return 0;
+}
+
+inline std::size_t extra_bytes(std::string const &str)
+{
+    return str.capacity();
+}
+
+template <class T>
+inline std::size_t extra_bytes(std::vector<T> const &elems)
+{
+    return elems.capacity() * sizeof(T);
+}
+
+inline std::size_t extra_bytes(boost::multiprecision::cpp_int const &n)
+{
+    return n.backend().size() * sizeof(boost::multiprecision::limb_type);
+}
+
+// The heap object behind a value of a non-immediate type. Types that hold
+// other values provide trace_children and clear_children overloads.
+template <class Rep>
+class boxed
+  : public heap_object
+{
+public:
+    template <class... Args>
+    explicit boxed(Args &&...args)
+      : rep(std::forward<Args>(args)...)
+    {}
+
+    void trace(heap_visitor &visitor) const override
+    {
+        trace_children(rep, visitor);
+    }
+
+    void clear() override
+    {
+        clear_children(rep);
+    }
+
+    std::size_t bytes() const override
+    {
+        return sizeof(*this) + extra_bytes(rep);
+    }
+
+    Rep rep;
+};
+}
+
+// A value is a type tag plus one word. Fixnums, flonums, booleans, nil and
+// symbols are stored in that word; everything else is a reference counted heap
+// object it points to. Checking the type is one load and compare.
 class value
 {
 public:
     struct function_rep
     {
-        std::vector<std::string> parameters;
-        boost::optional<std::string> variadic_argument;
-        std::vector<value> body;
+        std::vector<symbol> parameters;
+        boost::optional<symbol> variadic_argument;
+        std::shared_ptr<eval_detail::lambda_syntax const> body;
         environment closure;
     };
 
+    // Characters owned by something else, such as a mapped file, which
+    // owner keeps alive. Slicing one shares the owner instead of copying.
+    struct slice_rep
+    {
+        std::shared_ptr<void const> owner;
+        boost::string_view text;
+    };
+
+    // A primitive is called through plain function pointers. call takes
+    // any number of arguments, and is only reached with arity of them when
+    // arity is not -1. call1 and call2, when set, skip building the span
+    // for calls with one or two arguments.
+    struct primitive_rep
+    {
+        value (*call)(arguments);
+        value (*call1)(value const &);
+        value (*call2)(value const &, value const &);
+        int arity;
+    };
+
     using reps = boost::mpl::map<
-        boost::mpl::pair<atom, std::string>,
-        boost::mpl::pair<list, std::vector<value>>,
-        boost::mpl::pair<dotted_list, std::pair<std::vector<value>, value>>,
-        boost::mpl::pair<number, int>,
+        boost::mpl::pair<atom, symbol>,
+        boost::mpl::pair<nil, std::nullptr_t>,
+        boost::mpl::pair<pair, cons_cell>,
+        boost::mpl::pair<number, std::int64_t>,
+        boost::mpl::pair<flonum, double>,
+        boost::mpl::pair<bignum, boost::multiprecision::cpp_int>,
         boost::mpl::pair<string, std::string>,
+        boost::mpl::pair<string_slice, slice_rep>,
         boost::mpl::pair<bool_, bool>,
-        boost::mpl::pair<port, std::shared_ptr<std::fstream>>,
-        boost::mpl::pair<primitive_function, std::function<value (arguments)>>,
-        boost::mpl::pair<io_function, std::function<value (arguments)>>,
-        boost::mpl::pair<function, function_rep>>;
+        boost::mpl::pair<port, std::shared_ptr<file_port>>,
+        boost::mpl::pair<primitive_function, primitive_rep>,
+        boost::mpl::pair<io_function, primitive_rep>,
+        boost::mpl::pair<function, function_rep>,
+        boost::mpl::pair<vector, std::vector<value>>,
+        boost::mpl::pair<f64vector, std::vector<double>>,
+        boost::mpl::pair<s64vector, std::vector<std::int64_t>>,
+        boost::mpl::pair<hash_table, hash_table_rep>,
+        boost::mpl::pair<future, std::shared_ptr<future_rep>>>;
 
     template <class Type>
     using rep = typename boost::mpl::at<reps, Type>::type;
 
-    value()
-      : value(make<list>({}))
-    {}
+    // Tags are positions in this list. The immediate types come first.
+    using types = boost::mpl::vector<
+        nil,
+        bool_,
+        number,
+        atom,
+        flonum,
+        pair,
+        bignum,
+        string,
+        string_slice,
+        port,
+        primitive_function,
+        io_function,
+        function,
+        vector,
+        f64vector,
+        s64vector,
+        hash_table,
+        future>;
+
+    static constexpr std::uint32_t first_heap_tag = 5;
+
+    template <class Type>
+    static constexpr std::uint32_t tag_of()
+    {
+        return boost::mpl::find<types, Type>::type::pos::value;
+    }
+
+    template <class Type>
+    static constexpr bool is_immediate()
+    {
+        return tag_of<Type>() < first_heap_tag;
+    }
+
+    value() noexcept
+      : tag_(tag_of<nil>())
+    {
+        new (&data_) rep<nil>(nullptr);
+    }
+
+    value(value const &other) noexcept
+      : tag_(other.tag_), data_(other.data_)
+    {
+        if (is_heap())
+            object()->add_ref();
+    }
+
+    value(value &&other) noexcept
+      : tag_(other.tag_), data_(other.data_)
+    {
+        other.tag_ = tag_of<nil>();
+    }
+
+    value &operator=(value const &other) noexcept
+    {
+        value(other).swap(*this);
+        return *this;
+    }
+
+    value &operator=(value &&other) noexcept
+    {
+        value(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~value()
+    {
+        if (is_heap())
+            heap::release(object());
+    }
+
+    void swap(value &other) noexcept
+    {
+        std::swap(tag_, other.tag_);
+        std::swap(data_, other.data_);
+    }
 
     template <class Type>
     static value make(rep<Type> const &r)
     {
-        return value(boost::fusion::make_pair<Type>(r));
+        return construct<Type>(r);
+    }
+
+    template <class Type>
+    static value make(rep<Type> &&r)
+    {
+        return construct<Type>(std::move(r));
     }
 
     template <class Type>
     bool is() const
     {
-        return impl_.type() == typeid(boost::fusion::pair<Type, rep<Type>>);
+        return tag_ == tag_of<Type>();
     }
 
     template <class Type>
     rep<Type> &get()
     {
         BOOST_ASSERT(is<Type>());
-        return boost::get<boost::fusion::pair<Type, rep<Type>>>(impl_).second;
+        return access<Type>(std::integral_constant<bool, is_immediate<Type>()>());
     }
 
     template <class Type>
     rep<Type> const &get() const
     {
         BOOST_ASSERT(is<Type>());
-        return boost::get<boost::fusion::pair<Type, rep<Type>>>(impl_).second;
+        return const_cast<value &>(*this).access<Type>(
+            std::integral_constant<bool, is_immediate<Type>()>());
+    }
+
+    // The number of values sharing this one's heap object, or 0 for an
+    // immediate value.
+    std::size_t use_count() const
+    {
+        return is_heap() ? object()->use_count() : 0;
+    }
+
+    // Whether changing this value's heap object needs a
+    // heap::exclusive_section, since other threads may be reading it.
+    bool is_shared() const
+    {
+        return is_heap() && heap::is_shared(*object());
+    }
+
+    // Whether both are the same heap object, or immediates with the same
+    // bits, which is what eq hash tables compare.
+    bool identical(value const &other) const
+    {
+        return tag_ == other.tag_ && bits() == other.bits();
+    }
+
+    std::size_t identity_hash() const
+    {
+        return std::hash<std::uint64_t>()(bits() ^ (static_cast<std::uint64_t>(tag_) << 59));
+    }
+
+    void trace(heap_visitor &visitor) const
+    {
+        if (is_heap())
+            visitor.visit(object());
     }
 
 private:
-    using impl = boost::variant<
-        boost::fusion::pair<atom, rep<atom>>,
-        boost::recursive_wrapper<boost::fusion::pair<list, rep<list>>>,
-        boost::recursive_wrapper<boost::fusion::pair<dotted_list, rep<dotted_list>>>,
-        boost::fusion::pair<number, rep<number>>,
-        boost::fusion::pair<string, rep<string>>,
-        boost::fusion::pair<bool_, rep<bool_>>,
-        boost::fusion::pair<port, rep<port>>,
-        boost::fusion::pair<primitive_function, rep<primitive_function>>,
-        boost::fusion::pair<io_function, rep<io_function>>,
-        boost::fusion::pair<function, rep<function>>>;
+    using storage = std::aligned_storage<sizeof(void *), alignof(void *)>::type;
+
+    template <class Type, class Rep>
+    static value construct(Rep &&r)
+    {
+        value ret;
+        ret.tag_ = tag_of<Type>();
+        ret.emplace<Type>(
+            std::forward<Rep>(r),
+            std::integral_constant<bool, is_immediate<Type>()>());
+        return ret;
+    }
+
+    template <class Type, class Rep>
+    void emplace(Rep &&r, std::true_type)
+    {
+        new (&data_) rep<Type>(std::forward<Rep>(r));
+    }
+
+    template <class Type, class Rep>
+    void emplace(Rep &&r, std::false_type)
+    {
+        new (&data_) heap_object *(
+            new value_detail::boxed<rep<Type>>(std::forward<Rep>(r)));
+    }
 
     template <class Type>
-    value(boost::fusion::pair<Type, rep<Type>> const &p)
-      : impl_(p)
+    rep<Type> &access(std::true_type)
+    {
+        return *reinterpret_cast<rep<Type> *>(&data_);
+    }
+
+    template <class Type>
+    rep<Type> &access(std::false_type)
+    {
+        return static_cast<value_detail::boxed<rep<Type>> *>(object())->rep;
+    }
+
+    bool is_heap() const
+    {
+        return tag_ >= first_heap_tag;
+    }
+
+    heap_object *object() const
+    {
+        return *reinterpret_cast<heap_object * const *>(&data_);
+    }
+
+    // Immediates narrower than a word leave the rest as the null the
+    // default constructor stored, so equal values have equal bits.
+    std::uint64_t bits() const
+    {
+        std::uint64_t ret;
+        std::memcpy(&ret, &data_, sizeof(ret));
+        return ret;
+    }
+
+    std::uint32_t tag_;
+    storage data_;
+};
+
+static_assert(sizeof(value) == 16, "a value should be a tag and one word");
+
+namespace value_detail
+{
+template <value (*Fn)(value const &)>
+inline value call_unary(arguments args)
+{
+    return Fn(args.front());
+}
+
+template <value (*Fn)(value const &, value const &)>
+inline value call_binary(arguments args)
+{
+    return Fn(args[0], args[1]);
+}
+}
+
+inline value::primitive_rep make_primitive(value (*call)(arguments), int arity = -1)
+{
+    return {call, nullptr, nullptr, arity};
+}
+
+template <value (*Fn)(value const &)>
+inline value::primitive_rep make_unary_primitive()
+{
+    return {&value_detail::call_unary<Fn>, Fn, nullptr, 1};
+}
+
+template <value (*Fn)(value const &, value const &)>
+inline value::primitive_rep make_binary_primitive()
+{
+    return {&value_detail::call_binary<Fn>, nullptr, Fn, 2};
+}
+
+// Strings and string slices are both strings to the language.
+inline bool is_text(value const &val)
+{
+    return val.is<string>() || val.is<string_slice>();
+}
+
+inline boost::string_view text_of(value const &val)
+{
+    BOOST_ASSERT(is_text(val));
+    return val.is<string>() ? boost::string_view(val.get<string>()) : val.get<string_slice>().text;
+}
+
+// Pairs are immutable and share their tails, so car, cdr and cons are
+// constant time.
+struct cons_cell
+{
+    cons_cell(value const &car, value const &cdr)
+      : car(car), cdr(cdr)
+    {}
+
+    cons_cell(cons_cell const &) = default;
+    cons_cell(cons_cell &&) = default;
+
+    // Releases a uniquely owned tail one cell at a time, so that dropping a
+    // long list does not recurse once per element.
+    ~cons_cell()
+    {
+        auto rest = std::move(cdr);
+        while (rest.is<pair>() && rest.use_count() == 1)
+        {
+            auto next = std::move(rest.get<pair>().cdr);
+            rest = std::move(next);
+        }
+    }
+
+    value car;
+    value cdr;
+};
+
+inline void trace_children(cons_cell const &cell, heap_visitor &visitor)
+{
+    cell.car.trace(visitor);
+    cell.cdr.trace(visitor);
+}
+
+inline void clear_children(cons_cell &cell)
+{
+    cell.car = value();
+    cell.cdr = value();
+}
+
+inline value make_pair(value const &car, value const &cdr)
+{
+    return value::make<pair>(cons_cell(car, cdr));
+}
+
+// Builds a list in a single pass. The cells are linked up before they are
+// published as immutable pairs.
+template <class Iterator>
+inline value make_list(Iterator first, Iterator last, value const &tail = value())
+{
+    if (first == last)
+        return tail;
+    auto head = value::make<pair>(cons_cell(*first, value()));
+    auto cell = &head.get<pair>();
+    for (++first; first != last; ++first)
+    {
+        cell->cdr = value::make<pair>(cons_cell(*first, value()));
+        cell = &cell->cdr.get<pair>();
+    }
+    cell->cdr = tail;
+    return head;
+}
+
+template <class Range>
+inline value make_list(Range const &rng, value const &tail = value())
+{
+    return make_list(boost::begin(rng), boost::end(rng), tail);
+}
+
+inline value make_list(std::initializer_list<value> vals)
+{
+    return make_list(vals.begin(), vals.end());
+}
+
+// Iterates over the cars of a chain of pairs. The list being traversed must
+// outlive the iterator.
+class list_iterator
+  : public boost::iterator_facade<list_iterator, value const, boost::forward_traversal_tag>
+{
+public:
+    list_iterator()
+      : pos_(nullptr)
+    {}
+
+    explicit list_iterator(value const &val)
+      : pos_(val.is<pair>() ? &val : nullptr)
+    {}
+
+private:
+    friend class boost::iterator_core_access;
+
+    value const &dereference() const
+    {
+        return pos_->get<pair>().car;
+    }
+
+    void increment()
+    {
+        auto const &cdr = pos_->get<pair>().cdr;
+        pos_ = cdr.is<pair>() ? &cdr : nullptr;
+    }
+
+    bool equal(list_iterator const &other) const
+    {
+        return pos_ == other.pos_;
+    }
+
+    value const *pos_;
+};
+
+inline boost::iterator_range<list_iterator> list_elements(value const &val)
+{
+    return {list_iterator(val), list_iterator()};
+}
+
+// The value that ends a chain of pairs: nil for a proper list.
+inline value const &list_tail(value const &val)
+{
+    auto pos = &val;
+    while (pos->is<pair>())
+        pos = &pos->get<pair>().cdr;
+    return *pos;
+}
+
+inline bool is_proper_list(value const &val)
+{
+    return list_tail(val).is<nil>();
+}
+
+// The names bound by one frame, in slot order. Scopes are built while
+// analysing a form; every frame created for the same lambda shares one. The
+// scope of a lambda keeps its source, (parameters . body), so that the
+// lambda can be analysed again when an image is restored.
+struct scope
+{
+    std::shared_ptr<scope> parent;
+    std::vector<symbol> names;
+    std::unordered_map<symbol, std::size_t> slots;
+    value source;
+};
+
+class frame
+  : public heap_object
+{
+public:
+    frame(std::shared_ptr<scope> const &layout, environment const &parent)
+      : layout(layout), slots(layout->names.size()), parent(parent)
     {}
 
-    impl impl_;
+    void trace(heap_visitor &visitor) const override
+    {
+        for (auto const &slot : slots)
+            if (slot)
+                slot->trace(visitor);
+        if (parent)
+            visitor.visit(parent.get());
+    }
+
+    void clear() override
+    {
+        slots.clear();
+        parent.reset();
+    }
+
+    std::size_t bytes() const override
+    {
+        return sizeof(*this) + slots.capacity() * sizeof(slots[0]);
+    }
+
+    std::shared_ptr<scope> layout;
+    std::vector<boost::optional<value>> slots;
+    environment parent;
 };
+
+inline environment make_frame(std::shared_ptr<scope> const &layout, environment const &parent)
+{
+    // A new heap object already holds the reference being handed out.
+    return environment(new frame(layout, parent), false);
+}
+
+inline void trace_children(value::function_rep const &rep, heap_visitor &visitor)
+{
+    if (rep.closure)
+        visitor.visit(rep.closure.get());
+}
+
+inline void clear_children(value::function_rep &rep)
+{
+    rep.closure.reset();
+}
+
+// Unlike pairs, vectors are mutable, so they may also refer to themselves.
+inline void trace_children(std::vector<value> const &elems, heap_visitor &visitor)
+{
+    for (auto const &elem : elems)
+        elem.trace(visitor);
+}
+
+inline void clear_children(std::vector<value> &elems)
+{
+    elems.clear();
+}
 }
 
 #endif